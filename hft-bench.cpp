@@ -0,0 +1,256 @@
+// hft-bench.cpp
+// Benchmark suite for the engine in hft-sim.cpp: named, repeatable scenarios with
+// fixed seeds, warm-up, CPU pinning, repetitions and JSON output for tracking
+// regressions across commits.
+// - Each scenario is generated once into a flat list of steps (untimed setup steps
+//   plus timed steps) by driving a shadow Engine, so every repetition replays the
+//   identical command sequence on a fresh Engine
+// - Only timed steps are measured (rdtsc around Engine::apply), so generation and
+//   book setup never show up in the numbers
+// Compile: g++ -O3 -march=native -std=c++17 -pthread hft-bench.cpp -o hft_bench
+// Run:     ./hft_bench [--scenario name]... [--reps N] [--warmup N] [--core N] [--tag str] [--md] [--risk] [--journal file] [--list]
+//          --md attaches a MarketDataPublisher (no reader) to measure the feed's cost.
+//          --risk turns on pre-trade checks (limits that never bind) and self-trade prevention
+//          over 64 accounts; since STP cancels the occasional own-account maker, compare it
+//          against a plain run for the per-order overhead, not for identical trades.
+//          --journal <file> journals every command (setup included) to <file> with group commit
+//          and fdatasync; compare p99 against a run without it for the journal's cost.
+//          --batch N feeds runs of up to N consecutive timed steps through Engine::submitBatch;
+//          the histogram then holds one sample per batch (its mean ns per order), reported
+//          as batch_latency_ns: per-order tails are not measured in that mode.
+//          JSON goes to stdout, a human-readable summary to stderr.
+
+#define HFT_SIM_NO_MAIN
+#include "hft-sim.cpp"
+
+// ------------------------------- SCENARIOS -------------------------------
+struct BenchStep { OrderCmd cmd; bool timed; };
+
+// Builds steps while applying them to a shadow engine, so generators can look at the
+// real book state (what is resting where) instead of re-simulating it.
+struct StepBuilder {
+    Engine &shadow; vector<BenchStep> steps; u64 nextId = 1;
+    StepBuilder(Engine &e):shadow(e) {}
+    void add(const OrderCmd &c, bool timed) { steps.push_back({c, timed}); shadow.apply(c); }
+    static constexpr int ACCOUNTS = 64; // new orders are spread over accounts round-robin by id
+    u64 limit(Side s, Price px, i64 qty, bool timed, TimeInForce tif=TimeInForce::GFD) {
+        OrderCmd c; c.type = CmdType::NEW; c.clientId = nextId++; c.side = s; c.price = (int32_t)px; c.qty = (int32_t)qty; c.tif = tif; c.account = (uint8_t)(c.clientId % ACCOUNTS); add(c, timed); return c.clientId;
+    }
+    // iceberg / hidden order: an untimed PEAK record (its slice size) then the RESERVE order
+    u64 reserve(Side s, Price px, i64 qty, i64 display, bool timed) {
+        OrderCmd c; c.clientId = nextId++; c.side = s; c.price = (int32_t)px; c.account = (uint8_t)(c.clientId % ACCOUNTS);
+        if (display > 0) { c.type = CmdType::PEAK; c.qty = (int32_t)display; add(c, false); }
+        c.type = CmdType::RESERVE; c.qty = (int32_t)qty; add(c, timed); return c.clientId;
+    }
+    void market(Side s, i64 qty, bool timed) { OrderCmd c; c.type = CmdType::MARKET; c.clientId = nextId++; c.side = s; c.qty = (int32_t)qty; c.account = (uint8_t)(c.clientId % ACCOUNTS); add(c, timed); }
+    void cancel(u64 id, bool timed) { OrderCmd c; c.type = CmdType::CANCEL; c.clientId = id; add(c, timed); }
+    void replace(u64 id, Price px, i64 qty, bool timed) { OrderCmd c; c.type = CmdType::REPLACE; c.clientId = id; c.price = (int32_t)px; c.qty = (int32_t)qty; add(c, timed); }
+    bool live(u64 id) const { u64 eid = shadow.clientToEngine.find(id); return eid != DirectIdIndex::NONE && shadow.pool.cold(eid).active; }
+};
+
+struct Scenario {
+    const char *name, *what; u64 seed;
+    function<void(StepBuilder&, mt19937_64&)> build;
+};
+
+static constexpr Price MID = 100 * TICKS_PER_UNIT; // starting mid (100.00)
+
+static const vector<Scenario> &scenarios() {
+    static const vector<Scenario> all = {
+    {"passive_adds", "500k non-crossing limit adds within 500 ticks of mid", 1, [](StepBuilder &b, mt19937_64 &rng) {
+        for (int i=0;i<500000;i++) {
+            bool buy = rng() & 1; int off = 1 + (int)(rng() % 500);
+            b.limit(buy?Side::BUY:Side::SELL, buy ? MID-off : MID+off, 1 + (i64)(rng() % 100), true);
+        }
+    }},
+    {"deep_cancels", "cancel a random order from 8 ask levels of depth 4096 (re-added untimed)", 2, [](StepBuilder &b, mt19937_64 &rng) {
+        const int LEVELS = 8, DEPTH = 4096; vector<u64> ids; vector<Price> lvl;
+        for (int d=0;d<DEPTH;d++) for (int l=0;l<LEVELS;l++) { ids.push_back(b.limit(Side::SELL, MID+1+l, 10, false)); lvl.push_back(MID+1+l); }
+        for (int i=0;i<300000;i++) {
+            size_t k = rng() % ids.size();
+            b.cancel(ids[k], true); ids[k] = b.limit(Side::SELL, lvl[k], 10, false);
+        }
+    }},
+    {"market_sweeps", "market orders of 150-250 sweeping 2-4 levels of a 64x8 book, refilled untimed", 3, [](StepBuilder &b, mt19937_64 &rng) {
+        const int LEVELS = 64, DEPTH = 8; const i64 QTY = 10;
+        auto refill = [&](Side s) {
+            for (int l=1;l<=LEVELS;l++) { Price px = s==Side::SELL ? MID+l : MID-l; while ((int)b.shadow.book.peek(s, priceToIdx(px)).count < DEPTH) b.limit(s, px, QTY, false); }
+        };
+        refill(Side::SELL); refill(Side::BUY);
+        for (int i=0;i<100000;i++) {
+            Side s = (rng() & 1) ? Side::BUY : Side::SELL;
+            b.market(s, 150 + (i64)(rng() % 101), true); refill(s==Side::BUY ? Side::SELL : Side::BUY);
+        }
+    }},
+    {"iceberg_sweeps", "market_sweeps' flow against a book where half the orders are icebergs (slice 10 of 40) or hidden", 9, [](StepBuilder &b, mt19937_64 &rng) {
+        const int LEVELS = 64, DEPTH = 8; const i64 QTY = 10;
+        auto refill = [&](Side s) {
+            for (int l=1;l<=LEVELS;l++) {
+                Price px = s==Side::SELL ? MID+l : MID-l; unsigned k = 0;
+                while ((int)b.shadow.book.peek(s, priceToIdx(px)).count < DEPTH) {
+                    if (++k & 1) b.limit(s, px, QTY, false); else b.reserve(s, px, 4*QTY, (k & 2) ? QTY : 0, false);
+                }
+            }
+        };
+        refill(Side::SELL); refill(Side::BUY);
+        for (int i=0;i<100000;i++) {
+            Side s = (rng() & 1) ? Side::BUY : Side::SELL;
+            b.market(s, 150 + (i64)(rng() % 101), true); refill(s==Side::BUY ? Side::SELL : Side::BUY);
+        }
+    }},
+    {"replace_storm", "replaces on 50k resting orders: 50% size-down, 30% price move, 20% size-up", 4, [](StepBuilder &b, mt19937_64 &rng) {
+        struct Live { u64 id; Side side; Price px; i64 qty; }; vector<Live> live;
+        for (int i=0;i<50000;i++) {
+            bool buy = i & 1; int off = 1 + (int)(rng() % 200); i64 q = 50 + (i64)(rng() % 50);
+            Side s = buy?Side::BUY:Side::SELL; Price px = buy ? MID-off : MID+off;
+            live.push_back({b.limit(s, px, q, false), s, px, q});
+        }
+        for (int i=0;i<500000;i++) {
+            Live &o = live[rng() % live.size()]; unsigned r = (unsigned)(rng() % 10);
+            if (r < 5 && o.qty > 1) o.qty -= 1 + (i64)(rng() % (u64)max<i64>(1, o.qty/2));
+            else if (r < 8) { int off = 1 + (int)(rng() % 200); o.px = o.side==Side::BUY ? MID-off : MID+off; }
+            else o.qty += 1 + (i64)(rng() % 20);
+            if (o.qty < 1) o.qty = 1;
+            b.replace(o.id, o.px, o.qty, true);
+        }
+    }},
+    {"mixed_touch", "flow within 3 ticks of the touch: 55% limits, 25% cancels, 10% markets, 10% replaces", 5, [](StepBuilder &b, mt19937_64 &rng) {
+        vector<u64> recent;
+        for (int l=1;l<=20;l++) for (int d=0;d<20;d++) { recent.push_back(b.limit(Side::BUY, MID-l, 10, false)); recent.push_back(b.limit(Side::SELL, MID+l, 10, false)); }
+        for (int i=0;i<500000;i++) {
+            const OrderBook &bk = b.shadow.book; unsigned r = (unsigned)(rng() % 100);
+            Side s = (rng() & 1) ? Side::BUY : Side::SELL;
+            Price touch = s==Side::BUY ? (bk.bestBid != -1 ? idxToPrice(bk.bestBid) : MID-1) : (bk.bestAsk != -1 ? idxToPrice(bk.bestAsk) : MID+1);
+            Price px = touch + (Price)(rng() % 7) - 3;
+            if (r < 55) { recent.push_back(b.limit(s, px, 1 + (i64)(rng() % 20), true)); if (recent.size() > 4096) recent.erase(recent.begin(), recent.begin() + 2048); }
+            else if (r < 80) b.cancel(recent[rng() % recent.size()], true);
+            else if (r < 90) b.market(s, 1 + (i64)(rng() % 30), true);
+            else { u64 id = recent[rng() % recent.size()]; if (b.live(id)) b.replace(id, idxToPrice(b.shadow.pool.cold(b.shadow.clientToEngine.find(id)).priceIdx), 1 + (i64)(rng() % 20), true); else b.cancel(id, true); }
+        }
+    }},
+    {"fok_probes", "FOK buys/sells 1-40 ticks through a 64-level book of depth 4, about half rejected by the pre-check", 8, [](StepBuilder &b, mt19937_64 &rng) {
+        const int LEVELS = 64, DEPTH = 4; const i64 QTY = 10;
+        auto refill = [&](Side s) {
+            for (int l=1;l<=LEVELS;l++) { Price px = s==Side::SELL ? MID+l : MID-l; while ((int)b.shadow.book.peek(s, priceToIdx(px)).count < DEPTH) b.limit(s, px, QTY, false); }
+        };
+        refill(Side::SELL); refill(Side::BUY);
+        for (int i=0;i<200000;i++) {
+            Side s = (rng() & 1) ? Side::BUY : Side::SELL; int through = 1 + (int)(rng() % 40);
+            i64 avail = (i64)through * DEPTH * QTY; i64 q = avail / 2 + (i64)(rng() % (u64)avail); // fills when q <= avail
+            b.limit(s, s==Side::BUY ? MID + through : MID - through, q, true, TimeInForce::FOK); refill(s==Side::BUY ? Side::SELL : Side::BUY);
+        }
+    }},
+    {"wide_cancels", "cancel + re-add at random over 400k resting orders on 4000 levels (cache-missing)", 7, [](StepBuilder &b, mt19937_64 &rng) {
+        struct Live { u64 id; Side side; Price px; }; vector<Live> live;
+        auto add = [&](bool timed) { bool buy = rng() & 1; Price px = buy ? MID - 1 - (Price)(rng() % 2000) : MID + 1 + (Price)(rng() % 2000);
+                                     Side s = buy ? Side::BUY : Side::SELL; return Live{b.limit(s, px, 1 + (i64)(rng() % 50), timed), s, px}; };
+        for (int i=0;i<400000;i++) live.push_back(add(false));
+        for (int i=0;i<250000;i++) { size_t k = rng() % live.size(); b.cancel(live[k].id, true); live[k] = add(true); }
+    }},
+    {"trend_drift", "touch flow around a mid that climbs 1 tick per 8 events, 60k ticks (several windows)", 6, [](StepBuilder &b, mt19937_64 &rng) {
+        vector<u64> recent; Price mid = MID;
+        for (int i=0;i<480000;i++) {
+            if ((i & 7) == 0) ++mid;
+            unsigned r = (unsigned)(rng() % 100); Side s = (rng() & 1) ? Side::BUY : Side::SELL;
+            Price px = s==Side::BUY ? mid - 1 - (Price)(rng() % 20) : mid + 1 + (Price)(rng() % 20);
+            if (r < 70) { recent.push_back(b.limit(s, px, 1 + (i64)(rng() % 20), true)); if (recent.size() > 8192) recent.erase(recent.begin(), recent.begin() + 4096); }
+            else if (r < 90) b.cancel(recent[rng() % recent.size()], true);
+            else b.market(s, 1 + (i64)(rng() % 40), true);
+        }
+    }},
+    };
+    return all;
+}
+
+// ------------------------------- RUNNER ----------------------------------
+static bool withMarketData = false, withRisk = false;
+
+// shared by the shadow engine and every rep, so --risk changes the generated flow too
+static EngineConfig benchEngineConfig() {
+    EngineConfig cfg; cfg.poolCapacity = 1u<<20; cfg.idCapacity = 1u<<22;
+    if (withRisk) { cfg.risk.enabled = true; cfg.risk.maxOrderQty = 1'000'000; cfg.risk.collarTicks = 1'000'000; cfg.risk.maxOpenQty = INT64_MAX / 4; cfg.risk.maxOpenNotional = INT64_MAX / 4; }
+    return cfg;
+}
+
+struct RepResult { double nsPerOp; LatencyHistogram hist; };
+
+static size_t batchSize = 1;
+static string journalPath;
+
+static RepResult runOnce(const vector<BenchStep> &steps) {
+    Engine engine(benchEngineConfig());
+    unique_ptr<MarketDataPublisher> md; if (withMarketData) { md = make_unique<MarketDataPublisher>(1<<16); engine.setMarketData(md.get()); }
+    unique_ptr<Journal> journal; if (!journalPath.empty()) { journal = make_unique<Journal>(journalPath); engine.setJournal(journal.get()); }
+    LatencyHistogram hist; u64 ticks = 0, ops = 0;
+    vector<OrderCmd> burst(batchSize);
+    for (size_t i=0;i<steps.size();) {
+        if (!steps[i].timed) { engine.apply(steps[i++].cmd); continue; }
+        if (batchSize == 1) {
+            u64 t0 = readTsc(); engine.apply(steps[i++].cmd); u64 dt = readTsc() - t0;
+            hist.record(dt); ticks += dt; ++ops; continue;
+        }
+        size_t k = 0; while (k < batchSize && i < steps.size() && steps[i].timed) burst[k++] = steps[i++].cmd;
+        u64 t0 = readTsc(); engine.submitBatch(burst.data(), k); u64 dt = readTsc() - t0;
+        hist.record(dt / k); // one sample per batch, not k copies of its mean
+        ticks += dt; ops += k;
+    }
+    return { ops ? (double)TscClock::get().toNs(ticks) / (double)ops : 0.0, hist };
+}
+
+// cost of the readTsc pair wrapped around every timed step
+static double timerOverheadNs() {
+    const int N = 1'000'000; u64 ticks = 0;
+    for (int i=0;i<N;i++) { u64 t0 = readTsc(); u64 t1 = readTsc(); ticks += t1 - t0; }
+    return (double)TscClock::get().toNs(ticks) / N;
+}
+
+static string jsonEscape(const string &s) { string o; for (char c : s) { if (c=='"' || c=='\\') o += '\\'; o += c; } return o; }
+
+int main(int argc, char **argv) {
+    int reps = 5, warmup = 1, core = -1; string tag; vector<string> only;
+    for (int i=1;i<argc;i++) {
+        string a = argv[i];
+        if (a=="--list") { for (auto &sc : scenarios()) cout<<sc.name<<"  "<<sc.what<<"\n"; return 0; }
+        else if (a=="--reps" && i+1<argc) reps = max(1, atoi(argv[++i]));
+        else if (a=="--warmup" && i+1<argc) warmup = max(0, atoi(argv[++i]));
+        else if (a=="--core" && i+1<argc) core = atoi(argv[++i]);
+        else if (a=="--tag" && i+1<argc) tag = argv[++i];
+        else if (a=="--md") withMarketData = true;
+        else if (a=="--risk") withRisk = true;
+        else if (a=="--journal" && i+1<argc) journalPath = argv[++i];
+        else if (a=="--batch" && i+1<argc) batchSize = (size_t)max(1, atoi(argv[++i]));
+        else if (a=="--scenario" && i+1<argc) only.push_back(argv[++i]);
+        else { cerr<<"unknown option "<<a<<"\n"; return 2; }
+    }
+    bool pinned = core >= 0 && pinThread(core);
+    if (core >= 0 && !pinned) cerr<<"warning: could not pin to core "<<core<<"\n";
+    double overhead = timerOverheadNs();
+
+    cout<<"{\n  \"suite\": \"hft-bench\",\n  \"tag\": \""<<jsonEscape(tag)<<"\",\n  \"core\": "<<(pinned?core:-1)
+        <<",\n  \"market_data\": "<<(withMarketData?"true":"false")<<",\n  \"risk\": "<<(withRisk?"true":"false")<<",\n  \"journal\": "<<(journalPath.empty()?"false":"true")<<",\n  \"batch\": "<<batchSize<<",\n  \"reps\": "<<reps<<",\n  \"warmup\": "<<warmup<<",\n  \"timer_overhead_ns\": "<<overhead<<",\n  \"scenarios\": [";
+    bool first = true;
+    for (const Scenario &sc : scenarios()) {
+        if (!only.empty() && find(only.begin(), only.end(), sc.name) == only.end()) continue;
+        vector<BenchStep> steps;
+        { Engine shadow(benchEngineConfig()); StepBuilder b(shadow); mt19937_64 rng(sc.seed); sc.build(b, rng); steps.swap(b.steps); }
+        size_t timed = count_if(steps.begin(), steps.end(), [](const BenchStep &s){ return s.timed; });
+        for (int w=0;w<warmup;w++) runOnce(steps);
+        vector<double> ns; LatencyHistogram all;
+        for (int r=0;r<reps;r++) { RepResult rr = runOnce(steps); ns.push_back(rr.nsPerOp); all.merge(rr.hist); }
+        vector<double> sorted = ns; sort(sorted.begin(), sorted.end());
+        double median = sorted[sorted.size()/2];
+        const TscClock &c = TscClock::get();
+        cout<<(first?"":",")<<"\n    {\"name\": \""<<sc.name<<"\", \"seed\": "<<sc.seed<<", \"steps\": "<<steps.size()<<", \"timed_ops\": "<<timed
+            <<",\n     \"ns_per_op\": [";
+        for (size_t i=0;i<ns.size();i++) cout<<(i?", ":"")<<ns[i];
+        cout<<"],\n     \"ns_per_op_median\": "<<median<<", \"ns_per_op_min\": "<<sorted.front()<<", \"ns_per_op_max\": "<<sorted.back()
+            <<", \"mops_median\": "<<(median > 0 ? 1e3/median : 0.0)
+            <<",\n     \""<<(batchSize == 1 ? "latency_ns" : "batch_latency_ns")<<"\": {\"p50\": "<<c.toNs(all.percentile(0.50))<<", \"p99\": "<<c.toNs(all.percentile(0.99))
+            <<", \"p999\": "<<c.toNs(all.percentile(0.999))<<", \"max\": "<<c.toNs(all.maxV)<<"}}";
+        cerr<<left<<setw(15)<<sc.name<<right<<" median "<<setw(8)<<median<<(batchSize == 1 ? " ns/op  p99 " : " ns/op  batch p99 ")<<setw(6)<<c.toNs(all.percentile(0.99))
+            <<" ns  p99.9 "<<setw(6)<<c.toNs(all.percentile(0.999))<<" ns  ("<<timed<<" ops x "<<reps<<" reps)\n";
+        first = false;
+    }
+    cout<<"\n  ]\n}\n";
+    return 0;
+}
@@ -1,293 +1,2851 @@
 // hft_engine_simulation.cpp
 // A more feature-rich single-file HFT engine simulation for learning and prototyping.
 // - Modern C++17
-// - Tick-indexed order book with fixed-size ring buffers per price level
-// - Preallocated order pool + O(1) clientId -> engineId map for cancels/replaces
-// - Limit / Market orders, IOC, FOK flags, cancels, replaces
-// - Simple market-data feed & strategy (naive market-maker) for demo
-// - Single-threaded core matching loop (easy to extend to sharded multi-threading)
-// Compile: g++ -O3 -march=native -std=c++17 hft_engine_simulation.cpp -o hft_sim
+// - Tick-indexed order book: dense window that follows the mid + ordered overflow for far
+//   ticks; per-level FIFO queues linked through the order pool
+// - Preallocated order pool + O(1) clientId -> engineId index for cancels/replaces
+// - Limit / Market orders, IOC, FOK flags, cancels, replaces; iceberg and hidden reserve orders
+// - Optional pre-trade risk checks and self-trade prevention over flat per-account counters
+// - Fixed 64-byte execution reports (ack / fill / cancel / reject) written in place into a sink
+// - Incremental L1/L2 market-data deltas into a lock-free broadcast ring, top-N snapshots
+// - Single-threaded core matching loop; optional SPSC ingress ring + pinned matching thread
+// - Optional write-ahead command journal (I/O thread, group commit, O_DIRECT); snapshots
+// Compile: g++ -O3 -march=native -std=c++17 -pthread hft_engine_simulation.cpp -o hft_sim
+//          add -DHFT_LATENCY_STATS for per-operation latency histograms (p50/p99/p99.9/max)
+// Run:     ./hft_sim                 demo workload
+//          ./hft_sim --bench-cancel  cancel latency vs. level depth
+//          ./hft_sim --bench-idindex clientId index microbenchmark
+//          ./hft_sim --pipeline [spin|backoff] [core]  demo flow through the SPSC ingress + matching thread
+//          ./hft_sim --production [spin|backoff] [ingress match sink cores] [fifo prio]  pipeline pinned,
+//                    SCHED_FIFO, mlocked and pre-faulted; -DHFT_ALLOC_GUARD aborts on any later heap use
+//          ./hft_sim --bench-shards  ShardedEngine throughput for 1..16 shards
+//          ./hft_sim --flow [n]       pre-generated realistic flow, engine-only timing
+//          ./hft_sim --auction [n]    n limit orders collected in an auction call, then one uncross
+//          ./hft_sim --record <file>  capture the demo flow as a binary event file
+//          ./hft_sim --replay <file> [paced]  mmap + replay a capture into a fresh Engine
+//          ./hft_sim --record <file> <symbols>  capture a Zipf-skewed multi-symbol flow instead
+//          ./hft_sim --replay-parallel <file> [threads]  per-symbol replay on a work-stealing pool
+//          ./hft_sim --snapshot <file>  preload the demo book, save it as a snapshot
+//          ./hft_sim --restore <file>  run the demo from a snapshot instead of the preload
+//          ./hft_sim --journal <file> [snapshot]  run the demo with every command journaled to <file>,
+//                    saving [snapshot] halfway through
+//          ./hft_sim --recover <journal> [snapshot]  rebuild an engine from snapshot + journal tail
 
 #include <bits/stdc++.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 using namespace std;
 using u64 = unsigned long long;
 using i64 = long long;
-using TimePoint = chrono::high_resolution_clock::time_point;
 
 // ------------------------------- CONFIG ----------------------------------
-static constexpr int PRICE_LEVELS = 20001; // must be odd to have middle
-static constexpr double TICK = 0.01;
-static constexpr double MIN_PRICE = 0.0;
+static constexpr int PRICE_WINDOW = 1<<14; // dense levels per side around the mid (power of two)
+static constexpr int MAX_PRICE_WINDOW = 1<<24; // largest per-engine priceWindow
+static constexpr int RECENTER_STEP = 16;   // ticks the window slides per event while re-centering
+// Fixed-point prices: a Price is an integer number of ticks, TICKS_PER_UNIT to 1.0 of
+// currency. Book level index = price - MIN_PRICE_TICKS, a subtraction that folds away
+// for 0. Doubles only appear where prices enter or leave the process as decimals.
+using Price = int64_t;
+static constexpr Price TICKS_PER_UNIT = 100; // tick = 0.01
+static constexpr Price MIN_PRICE_TICKS = 0;
+// highest accepted tick. Book ticks are ints; the headroom below INT32_MAX keeps the window
+// arithmetic (base + window, t - base, t + 1) from overflowing. OrderCmd carries int32 ticks.
+static constexpr Price MAX_PRICE_TICKS = (1 << 30) - 1;
+static_assert(MAX_PRICE_TICKS + 2 * (Price)MAX_PRICE_WINDOW < INT32_MAX, "book tick arithmetic must fit in int");
+static constexpr i64 MAX_ORDER_QTY = 1'000'000'000;      // fits OrderCmd's int32 with room to mark an oversized one
 static constexpr size_t ORDER_POOL_CAPACITY = 3'000'000;
-static constexpr size_t RING_CAPACITY_PER_LEVEL = 4096; // tuned for demo
+static constexpr size_t ID_INDEX_CAPACITY = 1u<<22;       // dense clientIds below this are direct-indexed
+static constexpr uint32_t NIL = UINT32_MAX;              // null link in per-level order queues
 
 // ------------------------------- ENUMS -----------------------------------
 enum class Side : uint8_t { BUY = 0, SELL = 1 };
 enum class OrderType : uint8_t { LIMIT = 0, MARKET = 1 };
 enum class TimeInForce : uint8_t { GFD = 0, IOC = 1, FOK = 2 };
+enum class OrderKind : uint8_t { PLAIN = 0, ICEBERG = 1, HIDDEN = 2 }; // how a resting limit shows in the book
 
 // ------------------------------- UTIL ------------------------------------
 inline string sideName(Side s) { return s==Side::BUY?"BUY":"SELL"; }
-inline double idxToPrice(int idx) { return MIN_PRICE + idx * TICK; }
+inline constexpr int priceToIdx(Price p) { return (int)(p - MIN_PRICE_TICKS); }
+inline constexpr Price idxToPrice(int idx) { return MIN_PRICE_TICKS + idx; }
+static constexpr int priceDecimals(Price t) { return t <= 1 ? 0 : 1 + priceDecimals(t / 10); }
+static constexpr int PRICE_DECIMALS = priceDecimals(TICKS_PER_UNIT);
+static_assert([]{ Price t = 1; for (int i=0;i<PRICE_DECIMALS;i++) t *= 10; return t == TICKS_PER_UNIT; }(), "TICKS_PER_UNIT must be a power of ten");
+// edge conversions: decimal in (rounded once, here), decimal text out (exact)
+inline Price priceFromDouble(double px) { return (Price)llround(px * (double)TICKS_PER_UNIT); }
+inline string formatPrice(Price p) {
+    Price a = p < 0 ? -p : p; string frac = to_string(a % TICKS_PER_UNIT);
+    frac.insert(0, PRICE_DECIMALS - frac.size(), '0');
+    return (p < 0 ? "-" : "") + to_string(a / TICKS_PER_UNIT) + (PRICE_DECIMALS ? "." + frac : "");
+}
+
+// ------------------------------- CLOCK -----------------------------------
+// Cycle counter; falls back to steady_clock where there is no invariant TSC.
+inline u64 readTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (u64)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// TSC -> epoch ns, calibrated once per process against the system clock (~10 ms).
+struct TscClock {
+    u64 tscBase = 0, nsBase = 0, mult = 1ull<<32; // ns = nsBase + ((tsc - tscBase) * mult) >> 32
+    TscClock() {
+        auto ns = [] { return (u64)chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count(); };
+        u64 n0 = ns(), t0 = readTsc(), n1, t1;
+        do { n1 = ns(); t1 = readTsc(); } while (n1 - n0 < 10'000'000);
+        tscBase = t1; nsBase = n1; mult = (u64)((long double)(n1 - n0) / (long double)(t1 - t0) * 4294967296.0L);
+    }
+    inline u64 now() const { return nsBase + toNs(readTsc() - tscBase); }
+    inline u64 toNs(u64 ticks) const { return (u64)(((unsigned __int128)ticks * mult) >> 32); }
+    static const TscClock &get() { static const TscClock c; return c; }
+};
+
+// How the engine stamps inbound events. Every trade an event generates shares the
+// event's stamp, so the match loop never reads a clock.
+//   TSC     - calibrated rdtsc, one read per inbound event
+//   EVENT   - use the timestamp the caller passed in (gateway / capture time)
+//   LOGICAL - 1, 2, 3, ... per event; deterministic for replay
+enum class ClockMode : uint8_t { TSC = 0, EVENT = 1, LOGICAL = 2 };
+struct TimestampSource {
+    ClockMode mode;
+    u64 logical = 0;
+    const TscClock *tsc = nullptr;
+    bool held = false; u64 heldTs = 0; // hold(): TSC stamps reuse one reading, taken on first use
+    TimestampSource(ClockMode m=ClockMode::TSC):mode(m) { if (m==ClockMode::TSC) tsc = &TscClock::get(); }
+    void setMode(ClockMode m) { mode = m; if (m==ClockMode::TSC && !tsc) tsc = &TscClock::get(); }
+    inline u64 stamp(u64 eventTs) {
+        if (mode==ClockMode::EVENT) return eventTs;
+        if (mode==ClockMode::LOGICAL) return ++logical;
+        if (!held) return tsc->now();
+        return heldTs ? heldTs : (heldTs = tsc->now());
+    }
+    void hold() { held = true; heldTs = 0; }
+    void release() { held = false; }
+};
 
 // ------------------------------- ORDER -----------------------------------
+// Inbound order as seen by the matcher (the taker). Resting orders are stored
+// split into HotOrder/ColdOrder by the pool.
 struct Order {
     u64 clientId = 0;     // externally visible id
-    u64 engineId = 0;     // index in pool
     Side side = Side::BUY;
     OrderType type = OrderType::LIMIT;
     TimeInForce tif = TimeInForce::GFD;
+    uint8_t account = 0;  // risk / self-trade-prevention account
     int priceIdx = -1;    // -1 for market
     i64 qty = 0;          // remaining qty
     u64 ts = 0;           // arrival timestamp
+    OrderKind kind = OrderKind::PLAIN; // how the remainder rests
+};
+
+// What the sweep and cancel touch: remaining qty and the level queue links.
+struct alignas(16) HotOrder {
+    i64 qty = 0;          // remaining qty
+    uint32_t prev = NIL;  // intrusive links in its RingLevel queue (O(1) cancel)
+    uint32_t next = NIL;
+};
+static_assert(sizeof(HotOrder) == 16 && alignof(HotOrder) == 16, "four hot records per cache line");
+
+// Read on fills (maker id), cancels and replaces only.
+struct ColdOrder {
+    u64 clientId = 0;
+    u64 ts = 0;
+    int priceIdx = -1;
+    Side side = Side::BUY;
+    uint8_t account = 0;  // resting orders are always GFD limits, so no type or tif byte
+    OrderKind kind = OrderKind::PLAIN;
     bool active = false;  // set when placed in book
 };
+static_assert(sizeof(ColdOrder) == 24, "cold record layout");
+
+// An iceberg's hidden remainder and slice size; only read when ColdOrder::kind is
+// ICEBERG, so plain orders never touch (or fault in) this array.
+struct ReserveOrder { i64 reserve = 0; i64 peak = 0; };
 
 // --------------------------- ORDER POOL ----------------------------------
+// Structure-of-arrays: hot and cold records of engineId i live at hot(i) / cold(i).
+// Both arrays sit in a virtual reservation sized for `maxCapacity` records, so they
+// never move. `capacity` records are constructed (pre-faulted) up front; under
+// PoolExhaustion::GROW the constructed frontier is pushed ahead of the bump pointer
+// a little on every allocation (GROW_STEP records per call), so growing never stalls
+// a single event. Free slots are chained through HotOrder::next (no side list).
+enum class PoolExhaustion : uint8_t { REJECT = 0, GROW = 1 }; // allocate() returns NONE once past the limit
+enum class PoolPages : uint8_t { NORMAL = 0, TRANSPARENT = 1, HUGE_2M = 2, HUGE_1G = 3 };
+inline const char *poolPagesName(PoolPages p) { static const char *n[] = {"4k", "thp", "2M", "1G"}; return n[(int)p]; }
+
+// Anonymous reservation. HUGE_* maps explicit hugetlbfs pages (needs them reserved
+// via vm.nr_hugepages); if that fails it falls back to transparent huge pages.
+struct PoolRegion {
+    char *base = nullptr; size_t bytes = 0; PoolPages pages = PoolPages::NORMAL; bool mapped = false;
+    PoolRegion() = default;
+    PoolRegion(size_t want, PoolPages p) {
+#ifdef __unix__
+        static constexpr size_t HUGE_PAGE = 2u<<20;
+        for (;;) {
+#ifdef MAP_HUGETLB
+            if (p == PoolPages::HUGE_2M || p == PoolPages::HUGE_1G) {
+                size_t pg = p == PoolPages::HUGE_1G ? (1u<<30) : HUGE_PAGE; bytes = (want + pg - 1) / pg * pg;
+                int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (p == PoolPages::HUGE_1G ? (30 << MAP_HUGE_SHIFT) : (21 << MAP_HUGE_SHIFT));
+                void *m = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, flags, -1, 0);
+                if (m != MAP_FAILED) { base = (char*)m; pages = p; mapped = true; return; }
+                p = PoolPages::TRANSPARENT; continue;
+            }
+#endif
+            bytes = (want + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+            void *m = mmap(nullptr, bytes + HUGE_PAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (m == MAP_FAILED) throw runtime_error("order pool reservation failed");
+            char *a = (char*)(((uintptr_t)m + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1)); // 2M-aligned so THP can back it
+            if (a != (char*)m) munmap(m, (size_t)(a - (char*)m));
+            munmap(a + bytes, (size_t)((char*)m + bytes + HUGE_PAGE - (a + bytes)));
+            base = a; mapped = true; pages = PoolPages::NORMAL;
+#ifdef MADV_HUGEPAGE
+            if (p != PoolPages::NORMAL && madvise(base, bytes, MADV_HUGEPAGE) == 0) pages = PoolPages::TRANSPARENT;
+#endif
+            return;
+        }
+#else
+        (void)p; bytes = want; base = (char*)::operator new(bytes);
+#endif
+    }
+    PoolRegion(const PoolRegion&) = delete; PoolRegion &operator=(const PoolRegion&) = delete;
+    PoolRegion(PoolRegion &&o) noexcept { *this = std::move(o); }
+    PoolRegion &operator=(PoolRegion &&o) noexcept { swap(base, o.base); swap(bytes, o.bytes); swap(pages, o.pages); swap(mapped, o.mapped); return *this; }
+    ~PoolRegion() {
+#ifdef __unix__
+        if (base && mapped) munmap(base, bytes);
+#else
+        ::operator delete(base);
+#endif
+    }
+};
+
 struct OrderPool {
-    vector<Order> pool;
-    vector<u64> freeList;
-    OrderPool(size_t cap) { pool.resize(cap); freeList.reserve(cap); for (u64 i=0;i<cap;i++) freeList.push_back(cap-1-i); }
-    u64 allocate(const Order &o) {
-        if (freeList.empty()) throw runtime_error("Order pool exhausted");
-        u64 idx = freeList.back(); freeList.pop_back();
-        pool[idx] = o; pool[idx].engineId = idx; pool[idx].active = true;
+    static constexpr u64 NONE = UINT64_MAX;
+    static constexpr size_t GROW_STEP = 64;    // records constructed per allocate() while growing
+    static constexpr size_t GROW_AHEAD = 4096; // keep this many constructed beyond the bump pointer
+    PoolRegion hotMem, coldMem, resMem;
+    HotOrder *hotRecs = nullptr; ColdOrder *coldRecs = nullptr; ReserveOrder *resRecs = nullptr;
+    size_t constructed = 0, bump = 0, capacity, maxCapacity;
+    uint32_t freeHead = NIL;
+    PoolExhaustion policy;
+    u64 rejected = 0;
+    OrderPool(size_t cap, size_t maxCap=0, PoolExhaustion pol=PoolExhaustion::GROW, PoolPages pages=PoolPages::TRANSPARENT)
+        :capacity(cap), maxCapacity(pol==PoolExhaustion::GROW ? max(cap, maxCap ? maxCap : cap*4) : cap), policy(pol) {
+        if (maxCapacity >= NIL) throw runtime_error("order pool larger than 32-bit engine ids");
+        hotMem = PoolRegion(maxCapacity * sizeof(HotOrder), pages); coldMem = PoolRegion(maxCapacity * sizeof(ColdOrder), pages);
+        resMem = PoolRegion(maxCapacity * sizeof(ReserveOrder), pages); // not constructed: written when an iceberg rests
+        hotRecs = (HotOrder*)hotMem.base; coldRecs = (ColdOrder*)coldMem.base; resRecs = (ReserveOrder*)resMem.base;
+        construct(cap);
+    }
+    OrderPool(const OrderPool&) = delete; OrderPool &operator=(const OrderPool&) = delete;
+    // NONE when exhausted (REJECT, or GROW at maxCapacity); the caller drops the order
+    inline u64 allocate(const Order &o) {
+        u64 idx;
+        if (freeHead != NIL) { idx = freeHead; freeHead = hotRecs[idx].next; }
+        else if (bump < constructed) idx = bump++;
+        else { ++rejected; return NONE; }
+        if (policy == PoolExhaustion::GROW && constructed - bump < GROW_AHEAD && constructed < maxCapacity) construct(min(constructed + GROW_STEP, maxCapacity));
+        assign(idx, o);
         return idx;
     }
-    void free(u64 idx) {
-        pool[idx].active = false; pool[idx].qty = 0; freeList.push_back(idx);
+    // (re)fill slot idx from o; replace uses this to requeue without a free/allocate pair
+    inline void assign(u64 idx, const Order &o) {
+        hotRecs[idx].qty = o.qty;
+        coldRecs[idx] = ColdOrder{o.clientId, o.ts, o.priceIdx, o.side, o.account, o.kind, true};
+    }
+    inline void free(u64 idx) {
+        coldRecs[idx].active = false; hotRecs[idx].qty = 0; hotRecs[idx].next = freeHead; freeHead = (uint32_t)idx;
+    }
+    inline HotOrder& hot(u64 idx) { return hotRecs[idx]; }
+    inline ColdOrder& cold(u64 idx) { return coldRecs[idx]; }
+    inline ReserveOrder& res(u64 idx) { return resRecs[idx]; }
+    inline void setReserve(u64 idx, i64 reserve, i64 peak) { new (&resRecs[idx]) ReserveOrder{reserve, peak}; }
+    inline void prefetch(u64 idx) const { __builtin_prefetch(&hotRecs[idx], 1); __builtin_prefetch(&coldRecs[idx], 1); }
+    // the slot the next allocate() hands out (if nothing is freed first)
+    inline void prefetchNextFree() const { if (freeHead != NIL) prefetch(freeHead); else if (bump < constructed) prefetch(bump); }
+    // construct the rest of the reservation now (reserve records too), so neither GROW nor
+    // a first iceberg faults a page in later
+    void prefault() { construct(maxCapacity); memset((void*)resRecs, 0, maxCapacity * sizeof(ReserveOrder)); }
+    size_t committed() const { return constructed; }
+    PoolPages pages() const { return hotMem.pages; }
+    // snapshot load into a fresh pool: records [0, n) verbatim, free chain included
+    void restore(const HotOrder *h, const ColdOrder *c, size_t n, uint32_t free) {
+        if (bump) throw runtime_error("restore into a used order pool");
+        if (n > maxCapacity) throw runtime_error("snapshot larger than the order pool");
+        if (n > constructed) construct(n);
+        memcpy((void*)hotRecs, h, n * sizeof(HotOrder)); memcpy((void*)coldRecs, c, n * sizeof(ColdOrder));
+        bump = n; freeHead = free;
+    }
+private:
+    // placement-construct records [constructed, upTo); the writes fault the pages in
+    void construct(size_t upTo) {
+        for (size_t i = constructed; i < upTo; i++) { new (&hotRecs[i]) HotOrder(); new (&coldRecs[i]) ColdOrder(); }
+        constructed = upTo;
     }
-    Order& get(u64 idx) { return pool[idx]; }
 };
 
-// ----------------------- FIXED RING BUFFER (PER PRICE LEVEL) -------------
+// ----------------------- PRICE LEVEL QUEUE --------------------------------
+// FIFO of engineIds threaded through HotOrder::prev/next, so queue nodes come from the
+// shared OrderPool and a level is just this header (empty levels cost 32 bytes).
+// totalQty is everything executable at the level; hiddenQty / hiddenCount are the part
+// market data does not show (iceberg reserves, hidden orders).
 struct RingLevel {
-    vector<u64> data; // store engineId
-    size_t head = 0;  // pop from head
-    size_t tail = 0;  // push to tail
-    i64 totalQty = 0; // aggregate outstanding qty
-    RingLevel() { data.assign(RING_CAPACITY_PER_LEVEL, UINT64_MAX); }
-    inline bool empty() const { return head == tail; }
-    inline bool full() const { return ((tail + 1) % data.size()) == head; }
-    inline void push(u64 eid, i64 qty) {
-        if (full()) throw runtime_error("Price level ring full");
-        data[tail] = eid; tail = (tail + 1) % data.size(); totalQty += qty;
-    }
-    inline u64 front() const { return data[head]; }
-    inline void pop_front(i64 qty) {
+    uint32_t head = NIL; // pop from head
+    uint32_t tail = NIL; // push to tail
+    uint32_t count = 0;  // resting orders
+    uint32_t hiddenCount = 0; // of count: HIDDEN orders
+    i64 totalQty = 0;    // aggregate outstanding qty
+    i64 hiddenQty = 0;   // of totalQty: not displayed
+    inline bool empty() const { return head == NIL; }
+    inline i64 shownQty() const { return totalQty - hiddenQty; }
+    inline uint32_t shownCount() const { return count - hiddenCount; }
+    inline void push(OrderPool &p, u64 eid, i64 qty) {
+        HotOrder &o = p.hot(eid); o.prev = tail; o.next = NIL;
+        if (tail != NIL) p.hot(tail).next = (uint32_t)eid; else head = (uint32_t)eid;
+        tail = (uint32_t)eid; ++count; totalQty += qty;
+    }
+    inline u64 front() const { return head; }
+    inline void pop_front(OrderPool &p, i64 qty) {
         if (empty()) throw runtime_error("pop from empty level");
-        data[head] = UINT64_MAX; head = (head + 1) % data.size(); totalQty -= qty;
+        erase(p, head, qty);
+    }
+    // O(1) unlink from anywhere in the queue; everyone else keeps priority
+    inline void erase(OrderPool &p, u64 eid, i64 qty) {
+        HotOrder &o = p.hot(eid);
+        if (o.prev != NIL) p.hot(o.prev).next = o.next; else head = o.next;
+        if (o.next != NIL) p.hot(o.next).prev = o.prev; else tail = o.prev;
+        o.prev = o.next = NIL; --count; totalQty -= qty;
     }
+    // back of the queue with its totals unchanged (an iceberg's next slice)
+    inline void requeue(OrderPool &p, u64 eid) { if (tail != eid) { erase(p, eid, 0); push(p, eid, 0); } }
 };
+static_assert(sizeof(RingLevel) == 32, "keep the per-level header small");
+
+// -------------------------- OCCUPANCY BITMAP ------------------------------
+// Two-level bitmap over price levels: one bit per level, plus a summary bit per
+// non-zero word, so the next non-empty level is a couple of clz/ctz away.
+struct LevelBitmap {
+    int n;
+    vector<u64> words;   // bit (i&63) of words[i>>6] <=> level i non-empty
+    vector<u64> summary; // bit (w&63) of summary[w>>6] <=> words[w] != 0
+    LevelBitmap(int levels):n(levels), words((levels+63)/64, 0), summary((words.size()+63)/64, 0) {}
+    inline void set(int i) { words[i>>6] |= 1ull<<(i&63); summary[i>>12] |= 1ull<<((i>>6)&63); }
+    inline void clear(int i) { u64 &w = words[i>>6]; w &= ~(1ull<<(i&63)); if (!w) summary[i>>12] &= ~(1ull<<((i>>6)&63)); }
+    inline bool test(int i) const { return (words[i>>6]>>(i&63)) & 1; }
+    // highest non-empty level <= i, or -1
+    inline int prev(int i) const {
+        if (i < 0) return -1;
+        int w = i>>6; u64 m = words[w] & (~0ull >> (63-(i&63)));
+        if (m) return (w<<6) | (63-__builtin_clzll(m));
+        int sw = w>>6; u64 sm = (w&63) ? summary[sw] & (~0ull >> (64-(w&63))) : 0;
+        while (!sm) { if (--sw < 0) return -1; sm = summary[sw]; }
+        int nw = (sw<<6) | (63-__builtin_clzll(sm));
+        return (nw<<6) | (63-__builtin_clzll(words[nw]));
+    }
+    // lowest non-empty level >= i, or -1
+    inline int next(int i) const {
+        if (i >= n) return -1;
+        int w = i>>6; u64 m = words[w] & (~0ull << (i&63));
+        if (m) return (w<<6) | __builtin_ctzll(m);
+        int sw = w>>6; u64 sm = ((w&63)==63) ? 0 : summary[sw] & (~0ull << ((w&63)+1));
+        while (!sm) { if (++sw >= (int)summary.size()) return -1; sm = summary[sw]; }
+        int nw = (sw<<6) | __builtin_ctzll(sm);
+        return (nw<<6) | __builtin_ctzll(words[nw]);
+    }
+};
+
+// -------------------------- LEVEL AGGREGATE KERNELS -----------------------
+// Reductions over a contiguous run of per-level quantities q[0..n), tick of q[i] = t0 + i.
+// AVX-512 (with DQ for the 64-bit multiply) or AVX2 when the build enables them,
+// scalar otherwise; every variant returns the same exact integer results.
+//   qtySum   - sum q[i]
+//   qtyTicks - sum q[i] * (t0 + i) (notional in ticks x qty)
+//   reachUp / reachDown - walk from q[0] up (from q[n-1] down) until the running sum
+//              reaches `need`; returns the index of the level that gets there, or -1, and
+//              leaves the sum of the levels before it (or the whole run) in `before`
+static constexpr int AGG_CHUNK = 16; // levels summed per early-exit test in reachUp/reachDown
+inline i64 qtySum(const i64 *q, size_t n) {
+    size_t i = 0; i64 s = 0;
+#if defined(__AVX512F__)
+    __m512i a = _mm512_setzero_si512();
+    for (size_t nv = n & ~(size_t)7; i < nv; i += 8) a = _mm512_add_epi64(a, _mm512_loadu_si512(q + i));
+    if (i < n) { a = _mm512_add_epi64(a, _mm512_maskz_loadu_epi64((__mmask8)((1u << (n - i)) - 1), q + i)); i = n; }
+    alignas(64) i64 l[8]; _mm512_store_si512(l, a); s = l[0] + l[1] + l[2] + l[3] + l[4] + l[5] + l[6] + l[7];
+#elif defined(__AVX2__)
+    __m256i a = _mm256_setzero_si256();
+    for (size_t nv = n & ~(size_t)3; i < nv; i += 4) a = _mm256_add_epi64(a, _mm256_loadu_si256((const __m256i*)(q + i)));
+    alignas(32) i64 l[4]; _mm256_store_si256((__m256i*)l, a); s = l[0] + l[1] + l[2] + l[3];
+#endif
+    for (; i < n; i++) s += q[i];
+    return s;
+}
+inline i64 qtyTicks(const i64 *q, size_t n, i64 t0) {
+    size_t i = 0; i64 s = 0; // sum i*q[i]; t0 * sum q[i] is added at the end
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+    __m512i a = _mm512_setzero_si512(), idx = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0), step = _mm512_set1_epi64(8);
+    for (; i + 8 <= n; i += 8, idx = _mm512_add_epi64(idx, step)) a = _mm512_add_epi64(a, _mm512_mullo_epi64(_mm512_loadu_si512(q + i), idx));
+    if (i < n) { a = _mm512_add_epi64(a, _mm512_mullo_epi64(_mm512_maskz_loadu_epi64((__mmask8)((1u << (n - i)) - 1), q + i), idx)); i = n; }
+    alignas(64) i64 l[8]; _mm512_store_si512(l, a); s = l[0] + l[1] + l[2] + l[3] + l[4] + l[5] + l[6] + l[7];
+#elif defined(__AVX2__)
+    // no 64-bit multiply: i * q = i * lo32(q) + (i * hi32(q)) << 32 (i fits in 32 bits)
+    __m256i a = _mm256_setzero_si256(), idx = _mm256_set_epi64x(3, 2, 1, 0), step = _mm256_set1_epi64x(4);
+    for (; i + 4 <= n; i += 4, idx = _mm256_add_epi64(idx, step)) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(q + i));
+        a = _mm256_add_epi64(a, _mm256_add_epi64(_mm256_mul_epu32(v, idx), _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(v, 32), idx), 32)));
+    }
+    alignas(32) i64 l[4]; _mm256_store_si256((__m256i*)l, a); s = l[0] + l[1] + l[2] + l[3];
+#endif
+    for (; i < n; i++) s += (i64)i * q[i];
+    return s + t0 * qtySum(q, n);
+}
+inline long reachUp(const i64 *q, size_t n, i64 need, i64 &before) {
+    before = 0; size_t i = 0;
+    for (; i + AGG_CHUNK <= n; i += AGG_CHUNK) { i64 c = qtySum(q + i, AGG_CHUNK); if (before + c >= need) break; before += c; }
+    for (; i < n; i++) { if (before + q[i] >= need) return (long)i; before += q[i]; }
+    return -1;
+}
+inline long reachDown(const i64 *q, size_t n, i64 need, i64 &before) {
+    before = 0; size_t e = n; // levels [e, n) are consumed
+    for (; e >= (size_t)AGG_CHUNK; e -= AGG_CHUNK) { i64 c = qtySum(q + e - AGG_CHUNK, AGG_CHUNK); if (before + c >= need) break; before += c; }
+    for (; e > 0; e--) { if (before + q[e-1] >= need) return (long)(e - 1); before += q[e-1]; }
+    return -1;
+}
 
 // ------------------------------- ORDER BOOK -------------------------------
+// Free list of the far maps' tree nodes (a map allocates nothing else, so one node
+// size). Nodes come from CHUNK-node blocks and are recycled, never returned; after
+// OrderBook::reserveFar a far level appearing mid-session takes no trip to malloc.
+struct FarNodeArena {
+    static constexpr size_t CHUNK = 256;
+    vector<unique_ptr<char[]>> chunks; void *freeList = nullptr; size_t nodeBytes = 0;
+    FarNodeArena() = default;
+    FarNodeArena(const FarNodeArena&) = delete; FarNodeArena &operator=(const FarNodeArena&) = delete;
+    void *get(size_t bytes) {
+        if (!nodeBytes) nodeBytes = (max(bytes, sizeof(void*)) + 15) & ~(size_t)15;
+        if (bytes > nodeBytes) return ::operator new(bytes);
+        if (!freeList) refill(CHUNK);
+        void *p = freeList; freeList = *(void**)p; return p;
+    }
+    void put(void *p, size_t bytes) { if (bytes > nodeBytes) { ::operator delete(p); return; } *(void**)p = freeList; freeList = p; }
+private:
+    void refill(size_t n) {
+        chunks.emplace_back(new char[n * nodeBytes]); char *c = chunks.back().get();
+        for (size_t i = n; i-- > 0; ) put(c + i * nodeBytes, nodeBytes);
+    }
+};
+template<class T> struct FarAllocator {
+    using value_type = T;
+    FarNodeArena *arena;
+    FarAllocator(FarNodeArena *a) noexcept :arena(a) {}
+    template<class U> FarAllocator(const FarAllocator<U> &o) noexcept :arena(o.arena) {}
+    T *allocate(size_t n) { static_assert(alignof(T) <= 16, "far node alignment"); return (T*)arena->get(n * sizeof(T)); }
+    void deallocate(T *p, size_t n) noexcept { arena->put(p, n * sizeof(T)); }
+    template<class U> bool operator==(const FarAllocator<U> &o) const { return arena == o.arena; }
+    template<class U> bool operator!=(const FarAllocator<U> &o) const { return arena != o.arena; }
+};
+
+// Prices are absolute ticks. Each side keeps a dense window of `window` levels (power of
+// two) covering ticks [base, base+window), stored circularly at slot tick & mask, so
+// sliding the window never moves the levels that stay inside it. Non-empty levels
+// outside the window live in a per-side ordered map. The window follows the mid a few
+// ticks per event (recenter()); each step only re-homes the one tick leaving and the one
+// entering, and a level is a 32-byte header (its orders stay where they are in the pool).
+// Invariant: bestBid/bestAsk are -1 or a non-empty level; the bitmaps mirror !empty() of
+// the window slots; `far` holds only non-empty levels outside the window; qty[slot] ==
+// win[slot].totalQty once the engine has synced the level it touched (syncQty).
 struct OrderBook {
-    int nlevels;
-    vector<RingLevel> bids; // index 0..n-1, higher price = larger idx
-    vector<RingLevel> asks;
+    using FarMap = std::map<int, RingLevel, less<int>, FarAllocator<pair<const int, RingLevel>>>;
+    struct SideLevels {
+        vector<RingLevel> win; // slot = tick & mask
+        vector<i64> qty;       // win[slot].totalQty, contiguous for the aggregate kernels
+        LevelBitmap map;       // over slots
+        FarMap far;
+        SideLevels(int w, FarNodeArena *a):win(w), qty(w, 0), map(w), far(FarAllocator<pair<const int, RingLevel>>(a)) {}
+    };
+    FarNodeArena farNodes; // both sides' far maps; declared before sides
+    int window, mask;
+    int base = 0, target = 0; // window start; where recenter() is sliding it to
+    SideLevels sides[2];
     int bestBid = -1;
     int bestAsk = -1;
-    OrderBook(int levels=PRICE_LEVELS):nlevels(levels) { bids.resize(levels); asks.resize(levels); }
-    void updateBestAfterAdd(Side s, int idx) {
-        if (s==Side::BUY) { if (bestBid < idx) bestBid = idx; }
-        else { if (bestAsk == -1 || idx < bestAsk) bestAsk = idx; }
+    u64 recenterSteps = 0;
+    OrderBook(int levels=PRICE_WINDOW):window(levels), mask(levels-1), sides{SideLevels(levels, &farNodes), SideLevels(levels, &farNodes)} {
+        if (levels <= 0 || (levels & mask)) throw runtime_error("price window must be a power of two");
+        if (levels > MAX_PRICE_WINDOW) throw runtime_error("price window larger than MAX_PRICE_WINDOW");
+    }
+    OrderBook(const OrderBook&) = delete; OrderBook &operator=(const OrderBook&) = delete;
+    // put n far-level nodes on the free list (and fault them in) ahead of trading
+    void reserveFar(size_t n) {
+        FarMap tmp{FarAllocator<pair<const int, RingLevel>>(&farNodes)};
+        for (size_t i = 0; i < n; i++) tmp.emplace_hint(tmp.end(), (int)i, RingLevel());
+    }
+    inline bool inWindow(int t) const { return (unsigned)(t - base) < (unsigned)window; }
+    inline RingLevel &level(Side s, int t) { SideLevels &sl = sides[(int)s]; return inWindow(t) ? sl.win[t & mask] : sl.far[t]; }
+    // a level's totalQty: the contiguous array inside the window, the far map outside it
+    inline i64 levelQty(Side s, int t) const { return inWindow(t) ? sides[(int)s].qty[t & mask] : peek(s, t).totalQty; }
+    // read-only lookup that never creates a far level
+    inline const RingLevel &peek(Side s, int t) const {
+        static const RingLevel none;
+        const SideLevels &sl = sides[(int)s];
+        if (inWindow(t)) return sl.win[t & mask];
+        auto it = sl.far.find(t); return it == sl.far.end() ? none : it->second;
+    }
+    // mirrors a window level's new totalQty into the side's contiguous qty array
+    inline void syncQty(Side s, int t, i64 q) { if (inWindow(t)) sides[(int)s].qty[t & mask] = q; }
+    // far levels are not prefetched (they are map nodes, and rare)
+    inline void prefetch(Side s, int t) const { if (inWindow(t)) __builtin_prefetch(&sides[(int)s].win[t & mask], 1); }
+    // an empty book can re-anchor its window for free (there is nothing to move)
+    inline void anchor(int t) { if (bestBid == -1 && bestAsk == -1 && !inWindow(t)) base = target = t - window/2; }
+    void updateBestAfterAdd(Side s, int t) {
+        if (inWindow(t)) sides[(int)s].map.set(t & mask);
+        if (s==Side::BUY) { if (bestBid < t) bestBid = t; }
+        else { if (bestAsk == -1 || t < bestAsk) bestAsk = t; }
+    }
+    // call once the level at t has become empty
+    void updateBestAfterRemove(Side s, int t) {
+        if (inWindow(t)) sides[(int)s].map.clear(t & mask); else sides[(int)s].far.erase(t);
+        if (s==Side::BUY) { if (bestBid == t) bestBid = prev(s, t); }
+        else { if (bestAsk == t) bestAsk = next(s, t); }
+    }
+    // highest non-empty level <= t on side s, or -1
+    int prev(Side s, int t) const {
+        const SideLevels &sl = sides[(int)s]; int hi = base + window;
+        if (t >= hi) { auto it = sl.far.upper_bound(t); if (it != sl.far.begin() && (--it)->first >= hi) return it->first; t = hi - 1; }
+        if (t >= base) { int r = densePrev(sl.map, t); if (r != -1) return r; }
+        auto it = sl.far.upper_bound(min(t, base - 1));
+        return it == sl.far.begin() ? -1 : (--it)->first;
+    }
+    // lowest non-empty level >= t on side s, or -1
+    int next(Side s, int t) const {
+        const SideLevels &sl = sides[(int)s]; int hi = base + window;
+        if (t < base) { auto it = sl.far.lower_bound(t); if (it != sl.far.end() && it->first < base) return it->first; t = base; }
+        if (t < hi) { int r = denseNext(sl.map, t); if (r != -1) return r; t = hi; }
+        auto it = sl.far.lower_bound(t);
+        return it == sl.far.end() ? -1 : it->first;
+    }
+    // called once per event: pick a new target when the mid has drifted more than
+    // window/8 from the window centre, then slide at most RECENTER_STEP ticks towards it
+    void recenter() {
+        if (target == base) {
+            int mid = bestBid != -1 && bestAsk != -1 ? bestBid + (bestAsk - bestBid) / 2 : bestBid != -1 ? bestBid : bestAsk;
+            if (mid == -1) return;
+            int want = mid - window/2;
+            if (abs(want - base) <= window/8) return;
+            target = want;
+        }
+        for (int k=0;k<RECENTER_STEP && base != target;k++) {
+            if (base < target) { int s = base & mask; rehome(s, base, base + window); ++base; }
+            else { int s = (base - 1) & mask; rehome(s, base + window - 1, base - 1); --base; }
+            ++recenterSteps;
+        }
+    }
+    // snapshot load into an empty book: window position first, then each saved level
+    void restore(int b, int t, int bid, int ask) { base = b; target = t; bestBid = bid; bestAsk = ask; }
+    void restoreLevel(Side s, int t, const RingLevel &l) {
+        SideLevels &sl = sides[(int)s];
+        if (inWindow(t)) { sl.win[t & mask] = l; sl.qty[t & mask] = l.totalQty; sl.map.set(t & mask); } else sl.far.emplace(t, l);
+    }
+    // best-first walk of up to n non-empty levels on side s; returns how many
+    template<class F> int forTop(Side s, int n, F &&f) const {
+        int k = 0;
+        if (s==Side::BUY) { for (int i = bestBid; i != -1 && k < n; i = prev(s, i-1), ++k) f(i, peek(s, i)); }
+        else { for (int i = bestAsk; i != -1 && k < n; i = next(s, i+1), ++k) f(i, peek(s, i)); }
+        return k;
+    }
+    // the same over levels that display something (what market data shows): levels
+    // holding only hidden size are skipped
+    template<class F> int forShown(Side s, int n, F &&f) const {
+        int k = 0;
+        for (int i = s==Side::BUY ? bestBid : bestAsk; i != -1 && k < n; i = s==Side::BUY ? prev(s, i-1) : next(s, i+1))
+            if (const RingLevel &l = peek(s, i); l.shownQty()) { f(i, l); ++k; }
+        return k;
+    }
+    int bestShown(Side s) const { int b = -1; forShown(s, 1, [&](int i, const RingLevel&) { b = i; }); return b; }
+    // f(const i64 *q, size_t n, int firstTick) over the level quantities of side s at ticks
+    // [lo, hi], in ascending (desc = false) or descending tick order: window slots as at
+    // most two contiguous runs, far levels as runs of one. f returns false to stop.
+    template<class F> void forQtyRuns(Side s, int lo, int hi, bool desc, F &&f) const {
+        const SideLevels &sl = sides[(int)s];
+        auto farRuns = [&](int a, int b) {
+            if (a > b || sl.far.empty()) return true;
+            if (!desc) { for (auto it = sl.far.lower_bound(a); it != sl.far.end() && it->first <= b; ++it) if (!f(&it->second.totalQty, 1, it->first)) return false; }
+            else for (auto it = sl.far.upper_bound(b); it != sl.far.begin(); ) { if ((--it)->first < a) break; if (!f(&it->second.totalQty, 1, it->first)) return false; }
+            return true;
+        };
+        auto winRuns = [&] {
+            int wlo = max(lo, base), whi = min(hi, base + window - 1);
+            if (wlo > whi) return true;
+            int a = wlo & mask, b = whi & mask; const i64 *q = sl.qty.data();
+            if (a <= b) return f(q + a, (size_t)(b - a + 1), wlo);
+            int wrap = wlo + (window - a); // the tick stored at slot 0
+            return desc ? f(q, (size_t)(b + 1), wrap) && f(q + a, (size_t)(window - a), wlo)
+                        : f(q + a, (size_t)(window - a), wlo) && f(q, (size_t)(b + 1), wrap);
+        };
+        int below = min(hi, base - 1), above = max(lo, base + window);
+        if (!desc) (void)(farRuns(lo, below) && winRuns() && farRuns(above, hi));
+        else (void)(farRuns(above, hi) && winRuns() && farRuns(lo, below));
+    }
+    // resting size / notional (price ticks x qty) on side s at ticks [lo, hi]
+    i64 qtyWithin(Side s, int lo, int hi) const {
+        i64 t = 0; forQtyRuns(s, lo, hi, false, [&](const i64 *q, size_t n, int) { t += qtySum(q, n); return true; }); return t;
+    }
+    i64 notionalWithin(Side s, int lo, int hi) const {
+        i64 t = 0; forQtyRuns(s, lo, hi, false, [&](const i64 *q, size_t n, int t0) { t += qtyTicks(q, n, idxToPrice(t0)); return true; }); return t;
+    }
+    // cumulative size within `ticks` of side s's best (inclusive); 0 for an empty side
+    i64 depth(Side s, int ticks) const {
+        if (s==Side::BUY) return bestBid == -1 ? 0 : qtyWithin(s, bestBid - ticks, bestBid);
+        return bestAsk == -1 ? 0 : qtyWithin(s, bestAsk, (int)min<i64>((i64)bestAsk + ticks, MAX_PRICE_TICKS));
+    }
+    // what a taker on side s would get for `qty` at prices up to / down to limitIdx (-1: no
+    // limit), from level totals alone; nothing is matched. VWAP = notional / filled.
+    struct SweepEstimate { i64 filled = 0, notional = 0; };
+    SweepEstimate sweepCost(Side s, i64 qty, int limitIdx=-1) const {
+        SweepEstimate r; i64 need = qty;
+        sweepWalk(s, limitIdx, need, [&](const i64 *q, size_t n, int t0, long k, i64 before) {
+            if (k < 0) { r.filled += before; r.notional += qtyTicks(q, n, idxToPrice(t0)); return; }
+            r.filled += before + need; r.notional += need * idxToPrice(t0 + (int)k);
+            r.notional += s==Side::BUY ? qtyTicks(q, (size_t)k, idxToPrice(t0)) : qtyTicks(q + k + 1, n - (size_t)k - 1, idxToPrice(t0 + (int)k + 1));
+        });
+        return r;
+    }
+    // auction equilibrium of a crossed book: the tick in [bestAsk, bestBid] with the most
+    // executable volume min(bids at or above, asks at or below); ties go to the smaller
+    // imbalance (bid surplus, negative for an ask surplus), then to the tick nearest refIdx
+    // (-1: the middle of the range). One ascending pass over both sides' level quantities.
+    struct Equilibrium { int priceIdx = -1; i64 volume = 0, imbalance = 0; };
+    Equilibrium equilibrium(int refIdx=-1) const {
+        Equilibrium e;
+        if (bestBid == -1 || bestAsk == -1 || bestBid < bestAsk) return e;
+        int lo = bestAsk, hi = bestBid; if (refIdx < 0) refIdx = lo + (hi - lo) / 2;
+        i64 bids = qtyWithin(Side::BUY, lo, hi), asks = 0; // at or above t / at or below t
+        for (int t = lo; t <= hi; t++) {
+            asks += levelQty(Side::SELL, t);
+            i64 vol = min(bids, asks), imb = bids - asks;
+            if (vol > e.volume || (vol == e.volume && vol > 0 && (llabs(imb) < llabs(e.imbalance) || (llabs(imb) == llabs(e.imbalance) && abs(t - refIdx) < abs(e.priceIdx - refIdx)))))
+                e = Equilibrium{t, vol, imb};
+            bids -= levelQty(Side::BUY, t);
+        }
+        return e;
+    }
+    // FOK pre-check: can a taker on side s fill `need` at prices up to/down to limitIdx?
+    // Same walk as sweepCost over the crossable levels, without the notional.
+    bool canFill(Side s, int limitIdx, i64 need) const {
+        bool ok = false;
+        sweepWalk(s, limitIdx, need, [&](const i64*, size_t, int, long k, i64) { ok |= k >= 0; });
+        return ok;
+    }
+private:
+    // walks the maker side best-first across the levels a taker on side s can reach and
+    // calls g(q, n, firstTick, k, before) per run: k = level index in the run where `need`
+    // is met (then need = what that level still supplies, and the walk stops) or -1
+    template<class G> void sweepWalk(Side s, int limitIdx, i64 &need, G &&g) const {
+        bool buy = s==Side::BUY; int best = buy ? bestAsk : bestBid;
+        if (need <= 0 || best == -1) return;
+        int lo = buy ? best : (limitIdx < 0 ? INT_MIN : limitIdx), hi = buy ? (limitIdx < 0 ? INT_MAX : limitIdx) : best;
+        forQtyRuns(buy ? Side::SELL : Side::BUY, lo, hi, !buy, [&](const i64 *q, size_t n, int t0) {
+            i64 before; long k = buy ? reachUp(q, n, need, before) : reachDown(q, n, need, before);
+            if (k < 0) { need -= before; g(q, n, t0, k, before); return true; }
+            need -= before; g(q, n, t0, k, before); need = 0; return false;
+        });
+    }
+    // window-only searches; the slot range [base, t] / [t, base+window) may wrap
+    int densePrev(const LevelBitmap &m, int t) const {
+        int st = t & mask, sb = base & mask;
+        int r = m.prev(st);
+        if (st >= sb) return r >= sb ? t - (st - r) : -1;
+        if (r != -1) return t - (st - r);
+        r = m.prev(window - 1);
+        return r >= sb ? t - st - window + r : -1;
+    }
+    int denseNext(const LevelBitmap &m, int t) const {
+        int st = t & mask, se = (base - 1) & mask;
+        int r = m.next(st);
+        if (st <= se) return r != -1 && r <= se ? t + (r - st) : -1;
+        if (r != -1) return t + (r - st);
+        r = m.next(0);
+        return r != -1 && r <= se ? t + (window - st) + r : -1;
+    }
+    // slot s stops holding tick `out` and starts holding tick `in`, on both sides
+    void rehome(int s, int out, int in) {
+        for (SideLevels &sl : sides) {
+            RingLevel &w = sl.win[s];
+            if (!w.empty()) sl.far.emplace(out, w);
+            auto it = sl.far.empty() ? sl.far.end() : sl.far.find(in);
+            if (it != sl.far.end()) { w = it->second; sl.far.erase(it); sl.map.set(s); }
+            else if (!w.empty()) { w = RingLevel(); sl.map.clear(s); }
+            sl.qty[s] = w.totalQty;
+        }
+    }
+};
+
+// ------------------------------- ID INDEX --------------------------------
+// clientId -> engineId maps; Engine takes one as a template parameter.
+// Interface: find(id) -> engineId or NONE, insert(id, eid) (overwrites), erase(id),
+// prefetch(id) (pull in the entry a later find/insert will touch).
+
+// Open addressing, linear probing, backward-shift deletion (no tombstones).
+// Grows by doubling past 3/4 load, so size the capacity for the expected open orders.
+struct FlatIdIndex {
+    static constexpr u64 NONE = UINT64_MAX;
+    struct Slot { u64 key = NONE; u64 val = NONE; };
+    vector<Slot> slots; size_t mask = 0; size_t size = 0; int shift = 64;
+    FlatIdIndex(size_t cap=1u<<16) { size_t n = 16; while (n < cap) n <<= 1; rebuild(n); }
+    inline size_t home(u64 key) const { return (size_t)((key * 0x9E3779B97F4A7C15ull) >> shift); }
+    inline void prefetch(u64 key) const { __builtin_prefetch(&slots[home(key)]); }
+    inline u64 find(u64 key) const {
+        for (size_t i = home(key);; i = (i+1) & mask) {
+            const Slot &s = slots[i];
+            if (s.key == key) return s.val;
+            if (s.key == NONE) return NONE;
+        }
+    }
+    inline void insert(u64 key, u64 val) {
+        if ((size+1)*4 > slots.size()*3) grow();
+        for (size_t i = home(key);; i = (i+1) & mask) {
+            Slot &s = slots[i];
+            if (s.key == key) { s.val = val; return; }
+            if (s.key == NONE) { s.key = key; s.val = val; ++size; return; }
+        }
+    }
+    inline void erase(u64 key) {
+        size_t i = home(key);
+        for (;; i = (i+1) & mask) { if (slots[i].key == key) break; if (slots[i].key == NONE) return; }
+        // pull back any later entry in the cluster whose home does not lie in (i, j]
+        for (size_t j = (i+1) & mask; slots[j].key != NONE; j = (j+1) & mask) {
+            size_t h = home(slots[j].key);
+            if (((j - h) & mask) >= ((j - i) & mask)) { slots[i] = slots[j]; i = j; }
+        }
+        slots[i] = Slot{}; --size;
+    }
+    // size the table for n entries up front, so inserts up to n never grow it
+    void reserve(size_t n) { size_t cap = slots.size(); while (n*4 > cap*3) cap <<= 1; if (cap > slots.size()) rehash(cap); }
+private:
+    void rebuild(size_t n) { slots.assign(n, Slot{}); mask = n-1; shift = 64 - __builtin_ctzll(n); size = 0; }
+    void rehash(size_t n) { vector<Slot> old; old.swap(slots); rebuild(n); for (auto &s : old) if (s.key != NONE) insert(s.key, s.val); }
+    void grow() { rehash(slots.size()*2); }
+};
+
+// Direct-indexed array for dense ids (e.g. Engine::nextClientId); ids past the
+// array fall back to a FlatIdIndex.
+struct DirectIdIndex {
+    static constexpr u64 NONE = FlatIdIndex::NONE;
+    vector<u64> direct; FlatIdIndex overflow;
+    DirectIdIndex(size_t cap=ID_INDEX_CAPACITY):direct(cap, NONE) {}
+    inline u64 find(u64 key) const { return key < direct.size() ? direct[key] : overflow.find(key); }
+    inline void insert(u64 key, u64 val) { if (key < direct.size()) direct[key] = val; else overflow.insert(key, val); }
+    inline void erase(u64 key) { if (key < direct.size()) direct[key] = NONE; else overflow.erase(key); }
+    inline void prefetch(u64 key) const { if (key < direct.size()) __builtin_prefetch(&direct[key]); else overflow.prefetch(key); }
+    void reserve(size_t n) { overflow.reserve(n); } // n ids past the direct array
+};
+
+// ------------------------------- COMMANDS --------------------------------
+// Fixed-size inbound command, as carried by the ingress ring.
+// AUCTION opens a call (orders rest without matching), UNCROSS executes it; UNCROSS's
+// price is the tie-break reference tick (-1: the middle of the crossed range).
+// RESERVE is a NEW for an iceberg / hidden order; an iceberg's slice size does not fit
+// the record, so it travels in the qty of a PEAK record just before it (no PEAK: hidden).
+enum class CmdType : uint8_t { NEW = 0, CANCEL = 1, REPLACE = 2, MARKET = 3, AUCTION = 4, UNCROSS = 5, PEAK = 6, RESERVE = 7 };
+struct OrderCmd {
+    u64 clientId = 0;
+    u64 ts = 0;           // event time (used under ClockMode::EVENT)
+    int32_t qty = 0;      // NEW/MARKET size, REPLACE new size
+    uint32_t symbol = 0;  // routing key for ShardedEngine; ignored by a single Engine
+    int32_t price = -1;   // NEW price, REPLACE new price (ticks)
+    CmdType type = CmdType::NEW;
+    Side side = Side::BUY;
+    TimeInForce tif = TimeInForce::GFD;
+    uint8_t account = 0;  // RiskState account (NEW / MARKET)
+};
+static_assert(sizeof(OrderCmd) == 32, "OrderCmd is a fixed 32-byte record");
+// API price / size -> OrderCmd fields. Out-of-range values become ones the engine rejects the
+// same way (price -1: BAD_PRICE; size saturated past MAX_ORDER_QTY: BAD_QTY, or <= 0 for a
+// replace's cancel), never a wrapped, valid-looking one.
+inline int32_t cmdPrice(Price p) { return p >= MIN_PRICE_TICKS && p <= MAX_PRICE_TICKS ? (int32_t)p : -1; }
+inline int32_t cmdQty(i64 q) { return (int32_t)clamp<i64>(q, INT32_MIN, INT32_MAX); }
+
+// ------------------------------- LATENCY STATS ---------------------------
+// Log-linear (HDR-style) histogram: values below 16 are exact, above that there are
+// 16 linear sub-buckets per power of two (<= 1/16 relative error). Fixed array.
+struct LatencyHistogram {
+    static constexpr int SUB_BITS = 4, SUB = 1<<SUB_BITS, BUCKETS = (64 - SUB_BITS + 1) * SUB;
+    u64 counts[BUCKETS] = {}; u64 total = 0, maxV = 0;
+    static inline int bucketOf(u64 v) {
+        if (v < (u64)SUB) return (int)v;
+        int e = 63 - __builtin_clzll(v);
+        return (e - SUB_BITS + 1) * SUB + (int)((v >> (e - SUB_BITS)) & (SUB-1));
+    }
+    static inline u64 lowerBound(int b) { if (b < SUB) return (u64)b; int e = b / SUB + SUB_BITS - 1; return (u64)(SUB + b % SUB) << (e - SUB_BITS); }
+    inline void record(u64 v) { ++counts[bucketOf(v)]; ++total; if (v > maxV) maxV = v; }
+    // highest value equivalent to the p-quantile's bucket (capped at the max seen)
+    u64 percentile(double p) const {
+        if (!total) return 0;
+        u64 want = max<u64>(1, (u64)ceil(p * (double)total)), seen = 0;
+        for (int b=0;b<BUCKETS;b++) if ((seen += counts[b]) >= want) return min(maxV, b+1 < BUCKETS ? lowerBound(b+1) - 1 : maxV);
+        return maxV;
+    }
+    void merge(const LatencyHistogram &o) { for (int b=0;b<BUCKETS;b++) counts[b] += o.counts[b]; total += o.total; maxV = max(maxV, o.maxV); }
+    void clear() { *this = LatencyHistogram(); }
+};
+
+// Per-operation engine latency in TSC ticks, plus place/replace latency broken down
+// by how many price levels the sweep traded at. Only recorded in builds with
+// -DHFT_LATENCY_STATS; otherwise the instrumentation compiles to nothing.
+// submitBatch() does not time orders one by one: each batch adds one sample, its mean
+// ticks per command, to BATCH_ORDER. Its commands are only counted per op (`batched`),
+// so the per-op rows keep describing individually timed calls.
+enum class LatOp : uint8_t { PLACE_LIMIT = 0, PLACE_MARKET = 1, CANCEL = 2, REPLACE = 3, BATCH_ORDER = 4 };
+struct LatencyStats {
+    static constexpr int OPS = 5, LEVEL_BINS = 7;
+    static constexpr const char *opNames[OPS] = {"placeLimit", "placeMarket", "cancel", "replace", "batch/order"};
+    static constexpr const char *levelNames[LEVEL_BINS] = {"swept 0", "swept 1", "swept 2", "swept 3-4", "swept 5-8", "swept 9-16", "swept 17+"};
+    LatencyHistogram ops[OPS], byLevels[LEVEL_BINS];
+    u64 batched[OPS] = {}; // commands per op applied inside batches, not timed on their own
+    static constexpr int CMD_TYPES = 8; // op row per CmdType; -1: auction control / PEAK prefix, not timed
+    static constexpr int opOfCmd[CMD_TYPES] = {(int)LatOp::PLACE_LIMIT, (int)LatOp::CANCEL, (int)LatOp::REPLACE, (int)LatOp::PLACE_MARKET, -1, -1, -1, (int)LatOp::PLACE_LIMIT};
+    static inline int levelBin(int levels) { return levels <= 2 ? levels : min(LEVEL_BINS-1, 65 - __builtin_clzll((u64)(levels-1))); }
+    inline void record(LatOp op, u64 ticks, int levels) {
+        ops[(int)op].record(ticks);
+        if (op != LatOp::CANCEL && op != LatOp::BATCH_ORDER) byLevels[levelBin(levels)].record(ticks);
+    }
+    // a batch of n commands, perType[t] of them with CmdType t, in `ticks` altogether
+    void recordBatch(u64 ticks, const u64 *perType, size_t n) {
+        ops[(int)LatOp::BATCH_ORDER].record(ticks / n);
+        for (int t=0;t<CMD_TYPES;t++) if (opOfCmd[t] >= 0) batched[opOfCmd[t]] += perType[t];
     }
-    void updateBestAfterRemove(Side s, int idx) {
-        if (s==Side::BUY) {
-            if (bestBid != idx) return;
-            for (int i=idx;i>=0;--i) if (!bids[i].empty()) { bestBid = i; return; }
-            bestBid = -1;
-        } else {
-            if (bestAsk != idx) return;
-            for (int i=idx;i<nlevels;++i) if (!asks[i].empty()) { bestAsk = i; return; }
-            bestAsk = -1;
+    void merge(const LatencyStats &o) { for (int i=0;i<OPS;i++) { ops[i].merge(o.ops[i]); batched[i] += o.batched[i]; } for (int i=0;i<LEVEL_BINS;i++) byLevels[i].merge(o.byLevels[i]); }
+    static void row(ostream &os, const char *name, const LatencyHistogram &h) {
+        if (!h.total) return;
+        const TscClock &c = TscClock::get();
+        os<<"  "<<left<<setw(12)<<name<<right<<setw(10)<<h.total<<setw(9)<<c.toNs(h.percentile(0.50))<<setw(9)<<c.toNs(h.percentile(0.99))
+          <<setw(9)<<c.toNs(h.percentile(0.999))<<setw(10)<<c.toNs(h.maxV)<<"\n";
+    }
+    void report(ostream &os) const {
+        os<<"  "<<left<<setw(12)<<"op (ns)"<<right<<setw(10)<<"count"<<setw(9)<<"p50"<<setw(9)<<"p99"<<setw(9)<<"p99.9"<<setw(10)<<"max"<<"\n";
+        for (int i=0;i<OPS;i++) row(os, opNames[i], ops[i]);
+        for (int i=0;i<LEVEL_BINS;i++) row(os, levelNames[i], byLevels[i]);
+        if (ops[(int)LatOp::BATCH_ORDER].total) {
+            os<<"  batched (not timed per op):";
+            for (int i=0;i<OPS;i++) if (batched[i]) os<<" "<<opNames[i]<<" "<<batched[i];
+            os<<"\n";
+        }
+    }
+};
+
+#ifdef HFT_LATENCY_STATS
+#define HFT_LAT_ONLY(...) __VA_ARGS__
+#define HFT_LAT_SCOPE(op) LatencyScope hftLatScope_(stats, op, sweptLevels, !inBatch)
+// times the enclosing engine call unless `on` is false; reads the sweep's level count on exit
+struct LatencyScope {
+    LatencyStats &s; LatOp op; int &levels; bool on; u64 t0;
+    LatencyScope(LatencyStats &st, LatOp o, int &lv, bool enabled):s(st), op(o), levels(lv), on(enabled), t0(enabled ? readTsc() : 0) { levels = 0; }
+    ~LatencyScope() { if (on) s.record(op, readTsc() - t0, levels); }
+};
+#else
+#define HFT_LAT_ONLY(...)
+#define HFT_LAT_SCOPE(op) ((void)0)
+#endif
+
+// ------------------------------- MARKET DATA -----------------------------
+// Incremental book feed. The engine marks each level it touches during an event and,
+// once the event is done, publishes the final state of those levels (L2) plus a top-of-
+// book update per side whose best price or size moved (L1). Deltas go into a
+// single-producer broadcast ring: the producer never waits, each subscriber keeps its
+// own cursor and learns it was lapped from the slot version (seqlock per slot).
+// Only displayed size is published: iceberg reserves and hidden orders never appear.
+enum class MdKind : uint8_t { LEVEL = 0, TOP = 1 };
+struct MdDelta {
+    u64 ts;            // event stamp of the event that caused it
+    i64 qty;           // displayed level qty after the event (0 = level gone)
+    int32_t priceIdx;  // level, or for TOP the new best displayed level (-1 = none)
+    uint32_t count;    // displayed orders at the level
+    uint32_t symbol;
+    MdKind kind; Side side; uint16_t pad = 0;
+};
+static_assert(sizeof(MdDelta) == 32, "keep market-data deltas compact");
+
+enum class MdPoll : uint8_t { OK = 0, EMPTY = 1, LAPPED = 2 };
+struct MdRing {
+    struct Slot { atomic<u64> ver{0}; MdDelta d; }; // ver = 2*seq+1 while writing, 2*seq+2 once written
+    vector<Slot> slots; u64 mask;
+    alignas(64) atomic<u64> published{0}; // next sequence number
+    MdRing(size_t capPow2):slots(capPow2), mask(capPow2-1) { if (capPow2 & mask) throw runtime_error("MdRing capacity must be a power of two"); }
+    // producer (engine thread)
+    inline void push(const MdDelta &d) {
+        u64 n = published.load(memory_order_relaxed); Slot &s = slots[n & mask];
+        s.ver.store(2*n+1, memory_order_relaxed); atomic_thread_fence(memory_order_release);
+        s.d = d;
+        s.ver.store(2*n+2, memory_order_release); published.store(n+1, memory_order_release);
+    }
+    // any thread: read sequence n without blocking the producer
+    MdPoll read(u64 n, MdDelta &out) const {
+        const Slot &s = slots[n & mask];
+        u64 v = s.ver.load(memory_order_acquire);
+        if (v < 2*n+2) return MdPoll::EMPTY;
+        if (v > 2*n+2) return MdPoll::LAPPED;
+        out = s.d; atomic_thread_fence(memory_order_acquire);
+        return s.ver.load(memory_order_relaxed) == v ? MdPoll::OK : MdPoll::LAPPED;
+    }
+};
+
+// Top-N levels per side plus the sequence number of the first delta not reflected
+// in it; a (re)syncing subscriber loads the snapshot and continues from `seq`.
+struct BookSnapshot {
+    static constexpr int MAX_DEPTH = 32;
+    struct Level { int32_t priceIdx; uint32_t count; i64 qty; };
+    u64 seq = 0; u64 ts = 0; uint32_t symbol = 0; int nBids = 0, nAsks = 0;
+    Level bids[MAX_DEPTH], asks[MAX_DEPTH]; // best first
+};
+
+struct MarketDataPublisher {
+    static constexpr int DIRTY_CAP = 64; // touched levels buffered before a mid-event flush
+    MdRing ring;
+    int depth; // levels per side in snapshots
+    u64 deltas = 0;
+    MarketDataPublisher(size_t ringCap=1<<16, int snapshotDepth=10):ring(ringCap), depth(min(snapshotDepth, BookSnapshot::MAX_DEPTH)) {}
+
+    // engine side. touch() returns true when the buffer is full and the caller must
+    // flush() now; a level touched again after that is simply published again.
+    inline bool touch(Side s, int idx) {
+        if (nDirty && dirty[nDirty-1].idx == idx && dirty[nDirty-1].side == s) return false;
+        dirty[nDirty++] = {idx, s};
+        return nDirty == DIRTY_CAP;
+    }
+    void flush(const OrderBook &b, uint32_t symbol, u64 ts) {
+        for (int i=0;i<nDirty;i++) {
+            const RingLevel &l = b.peek(dirty[i].side, dirty[i].idx);
+            emit({ts, l.shownQty(), dirty[i].idx, l.shownCount(), symbol, MdKind::LEVEL, dirty[i].side});
+        }
+        nDirty = 0;
+    }
+    // end of event: flush levels, then L1 for each side that moved, then a requested snapshot
+    void publish(const OrderBook &b, uint32_t symbol, u64 ts) {
+        flush(b, symbol, ts);
+        top(b, Side::BUY, b.bestShown(Side::BUY), symbol, ts); top(b, Side::SELL, b.bestShown(Side::SELL), symbol, ts);
+        if (snapWanted.load(memory_order_relaxed)) { snapWanted.store(false, memory_order_relaxed); writeSnapshot(b, symbol, ts); }
+    }
+
+    // subscriber side (any thread)
+    u64 head() const { return ring.published.load(memory_order_acquire); }
+    void requestSnapshot() { snapWanted.store(true, memory_order_relaxed); }
+    // last snapshot the engine wrote; false if none yet or one is being written
+    bool readSnapshot(BookSnapshot &out) const {
+        u64 v = snapVer.load(memory_order_acquire);
+        if (v == 0 || (v & 1)) return false;
+        out = snap; atomic_thread_fence(memory_order_acquire);
+        return snapVer.load(memory_order_relaxed) == v;
+    }
+    // on the engine thread (or with the engine quiescent): snapshot without a request
+    void snapshotNow(const OrderBook &b, uint32_t symbol, u64 ts, BookSnapshot &out) const { fill(b, symbol, ts, out); }
+
+private:
+    struct Dirty { int idx; Side side; };
+    Dirty dirty[DIRTY_CAP]; int nDirty = 0;
+    int lastBest[2] = {-1, -1}; i64 lastTopQty[2] = {0, 0}; uint32_t lastTopCount[2] = {0, 0};
+    atomic<bool> snapWanted{false};
+    atomic<u64> snapVer{0}; BookSnapshot snap;
+
+    inline void emit(const MdDelta &d) { ring.push(d); ++deltas; }
+    void top(const OrderBook &b, Side s, int best, uint32_t symbol, u64 ts) {
+        int i = (int)s; i64 q = 0; uint32_t c = 0;
+        if (best != -1) { const RingLevel &l = b.peek(s, best); q = l.shownQty(); c = l.shownCount(); }
+        if (best == lastBest[i] && q == lastTopQty[i] && c == lastTopCount[i]) return;
+        lastBest[i] = best; lastTopQty[i] = q; lastTopCount[i] = c;
+        emit({ts, q, best, c, symbol, MdKind::TOP, s});
+    }
+    void fill(const OrderBook &b, uint32_t symbol, u64 ts, BookSnapshot &o) const {
+        o.seq = ring.published.load(memory_order_relaxed); o.ts = ts; o.symbol = symbol;
+        o.nBids = o.nAsks = 0;
+        b.forShown(Side::BUY, depth, [&](int idx, const RingLevel &l){ o.bids[o.nBids++] = {idx, l.shownCount(), l.shownQty()}; });
+        b.forShown(Side::SELL, depth, [&](int idx, const RingLevel &l){ o.asks[o.nAsks++] = {idx, l.shownCount(), l.shownQty()}; });
+    }
+    void writeSnapshot(const OrderBook &b, uint32_t symbol, u64 ts) {
+        u64 v = snapVer.load(memory_order_relaxed);
+        snapVer.store(v+1, memory_order_relaxed); atomic_thread_fence(memory_order_release);
+        fill(b, symbol, ts, snap);
+        snapVer.store(v+2, memory_order_release);
+    }
+};
+
+// One reader's cursor. Start from head() for live deltas only, or from a snapshot's
+// seq to resync; LAPPED means the ring overwrote unread deltas (take a new snapshot).
+struct MdSubscriber {
+    const MarketDataPublisher &pub; u64 next;
+    MdSubscriber(const MarketDataPublisher &p):pub(p), next(p.head()) {}
+    MdPoll poll(MdDelta &d) { MdPoll r = pub.ring.read(next, d); if (r==MdPoll::OK) ++next; return r; }
+};
+
+// ------------------------------- RISK ------------------------------------
+// Pre-trade checks and self-trade prevention. Accounts are small dense ids (one byte
+// in OrderCmd), so all per-account state is a flat array indexed by account: a check
+// is a few loads from one cache line, never a lookup or an allocation. Open qty and
+// notional (price ticks x qty) cover resting size only; the engine keeps them exact
+// on rest, fill, cancel and replace. Market orders get the size check only.
+static constexpr int MAX_ACCOUNTS = 256;
+enum class StpMode : uint8_t { NONE = 0, CANCEL_RESTING = 1, CANCEL_TAKER = 2 }; // which side of a self-match goes
+// MAX_QTY..OPEN_NOTIONAL are risk rejects; the rest only appear in execution reports
+enum class RejectReason : uint8_t { NONE = 0, MAX_QTY = 1, COLLAR = 2, OPEN_QTY = 3, OPEN_NOTIONAL = 4, BAD_PRICE = 5, UNKNOWN_ORDER = 6, POOL_FULL = 7, SELF_TRADE = 8, AUCTION_CALL = 9, BAD_QTY = 10 };
+static constexpr int REJECT_REASONS = 11;
+inline const char *rejectReasonName(RejectReason r) {
+    static const char *n[] = {"none", "max_qty", "collar", "open_qty", "open_notional", "bad_price", "unknown_order", "pool_full", "self_trade", "auction_call", "bad_qty"};
+    return n[(int)r];
+}
+
+struct RiskConfig {
+    bool enabled = false;            // off: no checks, no counters, no STP
+    i64 maxOrderQty = INT64_MAX;
+    Price collarTicks = INT32_MAX;   // buy <= bestAsk + collar, sell >= bestBid - collar (when that side exists)
+    i64 maxOpenQty = INT64_MAX;      // per-account defaults; RiskState::setLimits overrides one account
+    i64 maxOpenNotional = INT64_MAX;
+    StpMode stp = StpMode::CANCEL_RESTING;
+};
+
+struct alignas(32) AccountRisk { i64 openQty = 0, openNotional = 0, maxOpenQty = INT64_MAX, maxOpenNotional = INT64_MAX; };
+static_assert(sizeof(AccountRisk) == 32, "two accounts per cache line");
+
+struct RiskState {
+    RiskConfig cfg;
+    AccountRisk acct[MAX_ACCOUNTS];
+    u64 rejected[REJECT_REASONS] = {}; // by RejectReason
+    u64 stpCancels = 0;   // orders removed by self-trade prevention
+    RiskState(const RiskConfig &c=RiskConfig()):cfg(c) { for (auto &a : acct) { a.maxOpenQty = c.maxOpenQty; a.maxOpenNotional = c.maxOpenNotional; } }
+    void setLimits(uint8_t a, i64 maxQty, i64 maxNotional) { acct[a].maxOpenQty = maxQty; acct[a].maxOpenNotional = maxNotional; }
+    // freedQty/freedNotional: exposure the order gives back first (a replace's old size)
+    inline RejectReason check(uint8_t a, Side s, int priceIdx, i64 qty, int bestBid, int bestAsk, i64 freedQty=0, i64 freedNotional=0) {
+        RejectReason r = RejectReason::NONE; const AccountRisk &ar = acct[a];
+        if (qty > cfg.maxOrderQty) r = RejectReason::MAX_QTY;
+        else if (s==Side::BUY ? bestAsk != -1 && (i64)priceIdx > (i64)bestAsk + cfg.collarTicks : bestBid != -1 && (i64)priceIdx < (i64)bestBid - cfg.collarTicks) r = RejectReason::COLLAR;
+        else if (ar.openQty - freedQty + qty > ar.maxOpenQty) r = RejectReason::OPEN_QTY;
+        else if (ar.openNotional - freedNotional + qty * (i64)idxToPrice(priceIdx) > ar.maxOpenNotional) r = RejectReason::OPEN_NOTIONAL;
+        if (r != RejectReason::NONE) ++rejected[(int)r];
+        return r;
+    }
+    inline RejectReason checkMarket(i64 qty) {
+        if (qty <= cfg.maxOrderQty) return RejectReason::NONE;
+        ++rejected[(int)RejectReason::MAX_QTY]; return RejectReason::MAX_QTY;
+    }
+    inline void rest(uint8_t a, int priceIdx, i64 qty) { acct[a].openQty += qty; acct[a].openNotional += qty * (i64)idxToPrice(priceIdx); }
+    inline void release(uint8_t a, int priceIdx, i64 qty) { acct[a].openQty -= qty; acct[a].openNotional -= qty * (i64)idxToPrice(priceIdx); }
+    u64 totalRejected() const { u64 n = 0; for (u64 r : rejected) n += r; return n; }
+};
+
+// ---------------------------- EXEC REPORTS -------------------------------
+// One fixed 64-byte record per order-level outcome, written by the engine straight
+// into its sink's memory: an ack when an order (or a replace) is taken, a fill for
+// each side of every trade, a cancel for size that leaves the book without trading
+// (cancel, IOC / market / FOK remainder, self-trade prevention, pool full) and a
+// reject with its reason. qty is the fill or cancelled size, leaves what still rests.
+// A trade is the TAKER fill record; the MAKER one repeats it for the resting side.
+// An auction trade has no aggressor: both records are AUCTION, the buy one counts.
+enum class ExecType : uint8_t { ACCEPTED = 0, PARTIAL_FILL = 1, FILLED = 2, CANCELLED = 3, REJECTED = 4 };
+enum class Liquidity : uint8_t { NONE = 0, MAKER = 1, TAKER = 2, AUCTION = 3 };
+inline const char *execTypeName(ExecType t) { static const char *n[] = {"accepted", "partial_fill", "filled", "cancelled", "rejected"}; return n[(int)t]; }
+struct alignas(64) ExecReport {
+    u64 seq;          // per engine, 1, 2, 3, ...; deterministic for a given command sequence
+    u64 clientId;     // the order this report is about
+    u64 counterparty; // fills: the other side's clientId
+    u64 ts;           // the event's stamp (cancels/rejects not otherwise stamped carry the caller's eventTs)
+    i64 qty, leaves;
+    int32_t price;    // absolute ticks; 0 for market orders that never traded
+    uint32_t symbol;
+    ExecType type; Side side; RejectReason reason; uint8_t account; Liquidity liquidity;
+    uint8_t pad[3];
+    bool isTrade() const { return liquidity == Liquidity::TAKER || (liquidity == Liquidity::AUCTION && side == Side::BUY); }
+};
+static_assert(sizeof(ExecReport) == 64, "one report per cache line");
+
+// The engine asks its sink for a run of writable slots, fills them in place and
+// commits them: after each event (once per burst under submitBatch) or when the run
+// is used up. A run never outlives the event or burst it was reserved for, so
+// several engines may share one sink from the same thread.
+struct ReportSink {
+    virtual ~ReportSink() = default;
+    virtual ExecReport *reserve(size_t &n) = 0; // n: slots in the run, at least 1
+    virtual void commit(size_t n) = 0;          // the first n slots of the last run are written
+};
+// Discards reports, keeps the count (benchmarks, default sink); the scratch run stays in L1.
+struct NullReportSink : ReportSink {
+    static constexpr size_t RUN = 64;
+    ExecReport scratch[RUN]; u64 count = 0;
+    ExecReport *reserve(size_t &n) override { n = RUN; return scratch; }
+    void commit(size_t n) override { count += n; }
+};
+
+// ------------------------------- SPSC RING -------------------------------
+// Lock-free single-producer/single-consumer ring. Producer and consumer indices
+// live on separate cache lines, each side caches the other's index so the
+// shared line is only re-read when the ring looks full/empty.
+static constexpr size_t CACHE_LINE = 64;
+template<class T> struct SpscRing {
+    alignas(CACHE_LINE) atomic<u64> tail{0}; // written by producer
+    u64 cachedHead = 0;                      // producer's view of head
+    alignas(CACHE_LINE) atomic<u64> head{0}; // written by consumer
+    u64 cachedTail = 0;                      // consumer's view of tail
+    alignas(CACHE_LINE) vector<T> buf;
+    u64 mask;
+    SpscRing(size_t cap) { size_t n = 2; while (n < cap) n <<= 1; buf.resize(n); mask = n-1; }
+    inline bool tryPush(const T &v) {
+        u64 t = tail.load(memory_order_relaxed);
+        if (t - cachedHead > mask) { cachedHead = head.load(memory_order_acquire); if (t - cachedHead > mask) return false; }
+        buf[t & mask] = v; tail.store(t+1, memory_order_release); return true;
+    }
+    inline bool tryPop(T &v) {
+        u64 h = head.load(memory_order_relaxed);
+        if (h == cachedTail) { cachedTail = tail.load(memory_order_acquire); if (h == cachedTail) return false; }
+        v = buf[h & mask]; head.store(h+1, memory_order_release); return true;
+    }
+    // pop up to max entries with one head update; returns how many
+    inline size_t tryPopBatch(T *out, size_t max) {
+        u64 h = head.load(memory_order_relaxed);
+        if (cachedTail - h < max) cachedTail = tail.load(memory_order_acquire);
+        size_t n = (size_t)min<u64>(cachedTail - h, max);
+        for (size_t i=0;i<n;i++) out[i] = buf[(h+i) & mask];
+        if (n) head.store(h+n, memory_order_release);
+        return n;
+    }
+    // in-place producer side: the free slots from the tail up to the wrap (head is
+    // re-read when fewer than `want` look free), filled by the caller, then published
+    inline T *claim(size_t &n, size_t want=1) {
+        u64 t = tail.load(memory_order_relaxed);
+        if (mask + 1 - (t - cachedHead) < want) cachedHead = head.load(memory_order_acquire);
+        n = (size_t)min<u64>(mask + 1 - (t - cachedHead), mask + 1 - (t & mask));
+        return &buf[t & mask];
+    }
+    inline void publish(size_t n) { tail.store(tail.load(memory_order_relaxed) + n, memory_order_release); }
+    // in-place consumer side: f(const T&) on up to max entries, one head update
+    template<class F> inline size_t consume(F &&f, size_t max=SIZE_MAX) {
+        u64 h = head.load(memory_order_relaxed);
+        if (cachedTail - h < max) cachedTail = tail.load(memory_order_acquire);
+        size_t n = (size_t)min<u64>(cachedTail - h, max);
+        for (size_t i=0;i<n;i++) f((const T&)buf[(h+i) & mask]);
+        if (n) head.store(h+n, memory_order_release);
+        return n;
+    }
+    inline bool empty() const { return head.load(memory_order_acquire) == tail.load(memory_order_acquire); }
+};
+
+// ------------------------------- WAITING ---------------------------------
+// SPIN burns the core (lowest latency, needs a dedicated core); BACKOFF pauses,
+// then yields, then sleeps, so stages can share cores.
+enum class WaitMode : uint8_t { SPIN = 0, BACKOFF = 1 };
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+struct Waiter {
+    WaitMode mode; unsigned n = 0;
+    Waiter(WaitMode m):mode(m) {}
+    inline void reset() { n = 0; }
+    inline void idle() {
+        if (mode==WaitMode::SPIN) { cpuRelax(); return; }
+        if (n < 64) cpuRelax(); else if (n < 128) this_thread::yield(); else this_thread::sleep_for(chrono::microseconds(50));
+        ++n;
+    }
+};
+
+// Pin the calling thread; returns false if the core is unavailable. core < 0 is a no-op.
+inline bool pinThread(int core) {
+    if (core < 0) return true;
+#ifdef __linux__
+    cpu_set_t set; CPU_ZERO(&set); CPU_SET(core, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// ------------------------------- RUNTIME ---------------------------------
+// Production start-up: each stage thread (ingress, matching, report sink) gets a
+// ThreadPolicy (core, SCHED_FIFO priority, allocation guard), the process locks its
+// memory and the engine is pre-faulted before the first order. Steps the OS refuses
+// (no CAP_SYS_NICE / CAP_IPC_LOCK, core not present) are reported, not fatal.
+struct ThreadPolicy {
+    int core = -1;        // < 0: leave the affinity alone
+    int fifoPriority = 0; // 1..99: SCHED_FIFO at this priority; 0: keep the default policy
+    bool noAlloc = false; // arm the allocation guard while the thread is trading
+};
+struct ThreadPolicyStatus { bool pinned = true, realtime = true; };
+inline ThreadPolicyStatus applyThreadPolicy(const ThreadPolicy &p) {
+    ThreadPolicyStatus st; st.pinned = pinThread(p.core);
+    if (p.fifoPriority > 0) {
+#ifdef __linux__
+        sched_param sp{}; sp.sched_priority = p.fifoPriority;
+        st.realtime = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) == 0;
+#else
+        st.realtime = false;
+#endif
+    }
+    return st;
+}
+// mlockall(MCL_CURRENT | MCL_FUTURE): what is mapped now is faulted in and stays
+// resident, and later mappings are populated as they are made
+inline bool lockProcessMemory() {
+#ifdef __unix__
+    return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#else
+    return false;
+#endif
+}
+struct RuntimeConfig {
+    ThreadPolicy ingress, match, sink;
+    WaitMode wait = WaitMode::BACKOFF;
+    bool sinkThread = false; // drain reports on their own thread instead of the ingress thread
+    bool lockMemory = false; // lockProcessMemory() before the engine is pre-faulted
+    bool prefault = false;   // Engine::prefault before trading
+    size_t farLevels = 4096, overflowIds = 0; // what prefault reserves
+    // a SCHED_FIFO thread that spins never gives its core up, so under SPIN every
+    // realtime stage needs a core of its own and every other stage must be pinned elsewhere
+    bool realtimeSafe() const {
+        if (wait != WaitMode::SPIN) return true;
+        const ThreadPolicy *t[] = {&ingress, &match, &sink}; int n = sinkThread ? 3 : 2;
+        for (int i=0;i<n;i++) for (int j=0;j<n;j++)
+            if (i != j && t[i]->fifoPriority > 0 && (t[i]->core < 0 || t[j]->core < 0 || t[i]->core == t[j]->core)) return false;
+        return true;
+    }
+};
+
+// Allocation guard. Built with -DHFT_ALLOC_GUARD, global operator new checks a
+// thread-local flag: a thread inside a NoAllocScope that reaches the heap aborts with a
+// message (or, with abortOnAlloc cleared, is only counted). Otherwise the scope only
+// sets the flag and nothing reads it.
+struct AllocGuard {
+#ifdef HFT_ALLOC_GUARD
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+    static inline thread_local bool armed = false;
+    static inline atomic<u64> violations{0};
+    static inline bool abortOnAlloc = true;
+};
+struct NoAllocScope {
+    bool prev;
+    explicit NoAllocScope(bool on=true):prev(AllocGuard::armed) { if (on) AllocGuard::armed = true; }
+    ~NoAllocScope() { AllocGuard::armed = prev; }
+    NoAllocScope(const NoAllocScope&) = delete; NoAllocScope &operator=(const NoAllocScope&) = delete;
+};
+#ifdef HFT_ALLOC_GUARD
+static void *guardedAlloc(size_t n, size_t align) noexcept {
+    if (AllocGuard::armed) {
+        AllocGuard::violations.fetch_add(1, memory_order_relaxed);
+        if (AllocGuard::abortOnAlloc) { AllocGuard::armed = false; fputs("hft: heap allocation on a no-alloc thread\n", stderr); abort(); }
+    }
+    if (!n) n = 1;
+    return align > alignof(max_align_t) ? aligned_alloc(align, (n + align - 1) / align * align) : malloc(n);
+}
+// out of line so GCC does not pair the free() with the inlined operator new (-Wmismatched-new-delete)
+__attribute__((noinline)) static void guardedFree(void *p) noexcept { free(p); }
+void *operator new(size_t n) { if (void *p = guardedAlloc(n, 0)) return p; throw bad_alloc(); }
+void *operator new[](size_t n) { if (void *p = guardedAlloc(n, 0)) return p; throw bad_alloc(); }
+void *operator new(size_t n, align_val_t a) { if (void *p = guardedAlloc(n, (size_t)a)) return p; throw bad_alloc(); }
+void *operator new[](size_t n, align_val_t a) { if (void *p = guardedAlloc(n, (size_t)a)) return p; throw bad_alloc(); }
+void *operator new(size_t n, const nothrow_t&) noexcept { return guardedAlloc(n, 0); }
+void *operator new[](size_t n, const nothrow_t&) noexcept { return guardedAlloc(n, 0); }
+void *operator new(size_t n, align_val_t a, const nothrow_t&) noexcept { return guardedAlloc(n, (size_t)a); }
+void *operator new[](size_t n, align_val_t a, const nothrow_t&) noexcept { return guardedAlloc(n, (size_t)a); }
+void operator delete(void *p) noexcept { guardedFree(p); }
+void operator delete[](void *p) noexcept { guardedFree(p); }
+void operator delete(void *p, size_t) noexcept { guardedFree(p); }
+void operator delete[](void *p, size_t) noexcept { guardedFree(p); }
+void operator delete(void *p, align_val_t) noexcept { guardedFree(p); }
+void operator delete[](void *p, align_val_t) noexcept { guardedFree(p); }
+void operator delete(void *p, size_t, align_val_t) noexcept { guardedFree(p); }
+void operator delete[](void *p, size_t, align_val_t) noexcept { guardedFree(p); }
+void operator delete(void *p, const nothrow_t&) noexcept { guardedFree(p); }
+void operator delete[](void *p, const nothrow_t&) noexcept { guardedFree(p); }
+void operator delete(void *p, align_val_t, const nothrow_t&) noexcept { guardedFree(p); }
+void operator delete[](void *p, align_val_t, const nothrow_t&) noexcept { guardedFree(p); }
+#endif
+
+// ------------------------------- JOURNAL ---------------------------------
+// Write-ahead log of inbound commands, in arrival order. The engine thread only copies
+// each command into an SPSC ring, and waits only if the I/O thread is a whole ring
+// behind. An I/O thread drains whatever is queued, packs it into 4 KB pages and writes
+// the group with one pwrite plus one fdatasync (group commit). The file is opened
+// O_DIRECT where the filesystem allows it, so pages go from an aligned staging buffer
+// straight to the device; otherwise it falls back to buffered I/O. A page holds a
+// 32-byte header and 127 records. A group's last page may be partly filled; the next
+// group starts a fresh page after it, so bytes that durable() has acknowledged are never
+// rewritten (a light load costs file space, one page per group commit). Every page
+// carries a CRC32C of its header and records: a page torn by a crash fails it and ends
+// the valid prefix, which then holds only unacknowledged records. Each journal has a random id,
+// also in every page, that snapshots record to pair themselves with it. Engine state
+// is a pure function of this sequence, so snapshot + tail replay recovers it; trade
+// timestamps only repeat under ClockMode::LOGICAL / EVENT.
+inline uint32_t crc32c(const void *data, size_t n, uint32_t crc = 0) {
+    const unsigned char *p = (const unsigned char*)data; crc = ~crc;
+#ifdef __SSE4_2__
+    for (; n >= 8; n -= 8, p += 8) { u64 v; memcpy(&v, p, 8); crc = (uint32_t)_mm_crc32_u64(crc, v); }
+    for (; n; --n) crc = _mm_crc32_u8(crc, *p++);
+#else
+    for (; n; --n) { crc ^= *p++; for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1))); }
+#endif
+    return ~crc;
+}
+struct JournalPage {
+    static constexpr size_t BYTES = 4096, RECORDS = BYTES / sizeof(OrderCmd) - 1;
+    struct Header { char magic[4]; uint32_t crc; u64 journalId; u64 firstSeq; uint32_t pageNo, count; } hdr;
+    OrderCmd recs[RECORDS];
+    static constexpr char MAGIC[4] = {'H','F','J','2'};
+    void start(u64 id, uint32_t page, u64 seq) { memcpy(hdr.magic, MAGIC, 4); hdr.crc = 0; hdr.journalId = id; hdr.pageNo = page; hdr.firstSeq = seq; hdr.count = 0; }
+    uint32_t checksum() const { Header h = hdr; h.crc = 0; return crc32c(recs, hdr.count * sizeof(OrderCmd), crc32c(&h, sizeof(h))); }
+    void seal() { hdr.crc = checksum(); }
+    bool intact() const { return memcmp(hdr.magic, MAGIC, 4) == 0 && hdr.count <= RECORDS && hdr.crc == checksum(); }
+};
+static_assert(sizeof(JournalPage) == JournalPage::BYTES, "journal page layout");
+enum class JournalSync : uint8_t { NONE = 0, DATA = 1 }; // NONE: written to the page cache only
+
+struct Journal {
+    SpscRing<OrderCmd> ring;
+    u64 seq;                  // engine thread: sequence number of the next command
+    u64 stalls = 0;           // engine thread: appends that found the ring full
+    atomic<u64> durableSeq;   // every command below this is written (and synced under DATA)
+    atomic<u64> groups{0}, pagesWritten{0};
+    atomic<int> ioError{0};   // errno of a failed write; the I/O thread stops
+    u64 id;                   // random, nonzero: identifies this journal to snapshots
+    bool direct = false;      // opened with O_DIRECT
+    JournalSync sync; WaitMode wait;
+    int fd = -1; JournalPage *stage = nullptr; size_t stagePages;
+    atomic<bool> running{true}; thread th;
+    // firstSeq: where numbering starts (the next command after a recovery)
+    Journal(const string &path, size_t ringCap=1<<16, JournalSync s=JournalSync::DATA, WaitMode w=WaitMode::BACKOFF, int core=-1, u64 firstSeq=0, size_t groupPages=64)
+        :ring(ringCap), seq(firstSeq), durableSeq(firstSeq), id((u64(random_device{}()) << 32 ^ random_device{}() ^ (u64)chrono::steady_clock::now().time_since_epoch().count()) | 1),
+         sync(s), wait(w), stagePages(max<size_t>(2, groupPages)) {
+#ifdef __unix__
+#ifdef O_DIRECT
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644); direct = fd >= 0;
+#endif
+        if (fd < 0) fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw runtime_error("cannot create journal " + path);
+        stage = (JournalPage*)aligned_alloc(JournalPage::BYTES, stagePages * JournalPage::BYTES);
+        if (!stage) { ::close(fd); throw runtime_error("journal staging allocation failed"); }
+        memset((void*)stage, 0, stagePages * JournalPage::BYTES); stage[0].start(id, 0, firstSeq);
+        stage[0].seal(); // an empty first page, so the journal's id is durable before any snapshot names it
+        if (pwrite(fd, stage, JournalPage::BYTES, 0) != (ssize_t)JournalPage::BYTES || (sync == JournalSync::DATA && fdatasync(fd) != 0)) {
+            ::close(fd); ::free(stage); throw runtime_error("cannot write journal " + path);
+        }
+        stage[0].start(id, 1, firstSeq);
+        th = thread([this, core]{ run(core); });
+#else
+        (void)path; (void)core; throw runtime_error("journal needs POSIX file I/O");
+#endif
+    }
+    Journal(const Journal&) = delete; Journal &operator=(const Journal&) = delete;
+    ~Journal() { close(); }
+
+    // engine thread; throws once the I/O thread has failed (nothing after that is logged)
+    inline void append(const OrderCmd &c) {
+        if (ioError.load(memory_order_relaxed)) failed();
+        if (!ring.tryPush(c)) {
+            ++stalls; Waiter w(wait);
+            while (!ring.tryPush(c)) { if (ioError.load(memory_order_relaxed)) failed(); w.idle(); }
+        }
+        ++seq;
+    }
+    // any thread; waitDurable throws if the I/O thread fails before reaching s
+    u64 durable() const { return durableSeq.load(memory_order_acquire); }
+    void waitDurable(u64 s) const {
+        Waiter w(wait);
+        while (durable() < s) { if (ioError.load(memory_order_acquire)) failed(); w.idle(); }
+    }
+    // drains everything appended so far, then stops the I/O thread
+    void close() {
+        if (th.joinable()) { running.store(false, memory_order_release); th.join(); }
+#ifdef __unix__
+        if (fd >= 0) { ::close(fd); fd = -1; }
+#endif
+        ::free(stage); stage = nullptr;
+    }
+
+private:
+    [[noreturn]] __attribute__((noinline)) void failed() const { throw runtime_error(string("journal I/O failed: ") + strerror(ioError.load())); }
+    void run(int core) {
+#ifdef __unix__
+        pinThread(core); Waiter w(wait);
+        for (;;) {
+            bool stopping = !running.load(memory_order_acquire); // read before draining: nothing is lost
+            size_t i = 0, got = 0;
+            for (;;) { // stage[0] is the next unwritten page
+                JournalPage &p = stage[i];
+                size_t k = ring.tryPopBatch(p.recs + p.hdr.count, JournalPage::RECORDS - p.hdr.count);
+                p.hdr.count += (uint32_t)k; got += k;
+                if (p.hdr.count < JournalPage::RECORDS || i + 1 == stagePages) break;
+                stage[i+1].start(id, p.hdr.pageNo + 1, p.hdr.firstSeq + JournalPage::RECORDS); ++i;
+            }
+            if (!got) { if (stopping) break; w.idle(); continue; }
+            w.reset();
+            size_t last = stage[i].hdr.count ? i : i - 1, bytes = (last + 1) * JournalPage::BYTES;
+            for (size_t k = 0; k <= last; k++) stage[k].seal();
+            if (pwrite(fd, stage, bytes, (off_t)(stage[0].hdr.pageNo * JournalPage::BYTES)) != (ssize_t)bytes
+                || (sync == JournalSync::DATA && fdatasync(fd) != 0)) { ioError.store(errno ? errno : EIO, memory_order_relaxed); break; }
+            const JournalPage &l = stage[last];
+            durableSeq.store(l.hdr.firstSeq + l.hdr.count, memory_order_release);
+            groups.fetch_add(1, memory_order_relaxed); pagesWritten.fetch_add(last + 1, memory_order_relaxed);
+            stage[0].start(id, l.hdr.pageNo + 1, l.hdr.firstSeq + l.hdr.count); // never reopen a written page
         }
+#else
+        (void)core;
+#endif
     }
 };
 
-// ------------------------------- TRADE -----------------------------------
-struct Trade { u64 takerClient; u64 makerClient; i64 qty; int priceIdx; u64 ts; };
+// Walk a journal's valid prefix: f(seq, cmd) per record. Stops at the first page that
+// fails its checksum, is out of sequence or belongs to another journal (partly filled
+// pages end a group, not the journal). Returns the sequence number after the last record.
+template<class F> u64 readJournal(const string &path, F &&f) {
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) throw runtime_error("cannot open journal " + path);
+    JournalPage p; u64 next = 0, id = 0;
+    for (uint32_t page = 0; fread(&p, sizeof(p), 1, in) == 1; page++) {
+        if (!p.intact() || p.hdr.pageNo != page || (page && (p.hdr.firstSeq != next || p.hdr.journalId != id))) break;
+        id = p.hdr.journalId;
+        for (uint32_t i = 0; i < p.hdr.count; i++) f(p.hdr.firstSeq + i, p.recs[i]);
+        next = p.hdr.firstSeq + p.hdr.count;
+    }
+    fclose(in);
+    return next;
+}
+// The id in a journal's first page; 0 when that page is not intact
+inline u64 journalIdOf(const string &path) {
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) throw runtime_error("cannot open journal " + path);
+    JournalPage p; bool ok = fread(&p, sizeof(p), 1, in) == 1 && p.intact() && p.hdr.pageNo == 0;
+    fclose(in);
+    return ok ? p.hdr.journalId : 0;
+}
 
 // ------------------------------- ENGINE ----------------------------------
-struct Engine {
+// Sizing for one Engine (= one symbol's book). Defaults match the single-book demo;
+// sharded setups with many symbols per core shrink these.
+struct EngineConfig {
+    size_t poolCapacity = ORDER_POOL_CAPACITY;   // records pre-faulted at construction
+    size_t poolMaxCapacity = 0;                  // GROW limit (virtual reservation); 0 = 4 x poolCapacity
+    PoolExhaustion poolExhaustion = PoolExhaustion::GROW;
+    PoolPages poolPages = PoolPages::TRANSPARENT;
+    size_t idCapacity = ID_INDEX_CAPACITY;
+    int priceWindow = PRICE_WINDOW; // dense levels per side; ticks outside it still trade
+    uint32_t symbol = 0; // stamped on every ExecReport
+    RiskConfig risk;     // pre-trade checks + STP (off by default)
+};
+
+template<class IdIndex = DirectIdIndex>
+struct BasicEngine {
     OrderPool pool;
     OrderBook book;
-    unordered_map<u64,u64> clientToEngine; // clientId -> engineId (for last active order per client)
-    vector<Trade> trades;
+    IdIndex clientToEngine; // clientId -> engineId (for last active order per client)
+    NullReportSink nullSink;
+    ReportSink *sink = &nullSink;
+    MarketDataPublisher *md = nullptr; // optional L1/L2 delta feed
+    Journal *journal = nullptr;        // optional write-ahead log of inbound commands
+    u64 mdTs = 0;                      // stamp of the event being processed, for deltas
+    ExecReport *rep = nullptr, *repBase = nullptr, *repEnd = nullptr; // run reserved from the sink, filled in place
+    bool holdReports = false; // submitBatch: one commit per burst
+    bool auction = false;     // call phase: limit orders rest unmatched until uncross()
+    i64 pendingPeak = 0;      // slice size from a PEAK record, for the RESERVE that follows
+    i64 takerPeak = 0;        // slice size of the iceberg taker in flight (kept off Order)
+    u64 reportSeq = 0, tradeCount = 0;
+    TimestampSource clock;
     u64 nextClientId = 1;
-    Engine(): pool(ORDER_POOL_CAPACITY), book(PRICE_LEVELS) { clientToEngine.reserve(1<<20); trades.reserve(1<<20); }
+    uint32_t symbol;
+    RiskState risk;
+    HFT_LAT_ONLY(LatencyStats stats; int sweptLevels = 0; bool inBatch = false;)
+    static constexpr size_t PREFETCH_DIST = 8; // submitBatch: orders ahead whose records are prefetched
+    BasicEngine(const EngineConfig &cfg=EngineConfig())
+        :pool(cfg.poolCapacity, cfg.poolMaxCapacity, cfg.poolExhaustion, cfg.poolPages), book(cfg.priceWindow), clientToEngine(cfg.idCapacity), symbol(cfg.symbol), risk(cfg.risk) {}
+    void setSink(ReportSink *s) { flushReports(); sink = s ? s : &nullSink; }
+    void setMarketData(MarketDataPublisher *p) { md = p; }
+    void setJournal(Journal *j) { journal = j; } // detach while replaying a journal into the engine
+    // start-up, before the first order: fault in the whole pool reservation and reserve
+    // far-level nodes and id-index overflow slots, so the match loop neither takes page
+    // faults nor allocates unless it outgrows these
+    void prefault(size_t farLevels, size_t overflowIds) { pool.prefault(); book.reserveFar(farLevels); clientToEngine.reserve(overflowIds); }
 
     // helpers
-    inline bool validIdx(int idx) const { return idx >=0 && idx < book.nlevels; }
+    inline bool validPrice(Price p) const { return p >= MIN_PRICE_TICKS && p <= MAX_PRICE_TICKS; } // no price is clamped inside this range
+    inline bool validQty(i64 q) const { return q > 0 && q <= MAX_ORDER_QTY; }
 
     // place limit order (aggressive match then add passive remainder)
-    void placeLimit(u64 clientId, Side side, int priceIdx, i64 qty, TimePoint now, TimeInForce tif=TimeInForce::GFD) {
-        Order taker; taker.clientId = clientId; taker.side = side; taker.type = OrderType::LIMIT; taker.priceIdx = priceIdx; taker.qty = qty; taker.ts = (u64)chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count(); taker.tif = tif;
-        matchAndAdd(taker);
+    // eventTs is only used under ClockMode::EVENT; otherwise the engine stamps the order
+    // a reject drops the order before it is stamped (risk rejects are counted in risk.rejected)
+    void placeLimit(u64 clientId, Side side, Price price, i64 qty, u64 eventTs=0, TimeInForce tif=TimeInForce::GFD, uint8_t account=0) {
+        HFT_LAT_SCOPE(LatOp::PLACE_LIMIT);
+        journalCmd(CmdType::NEW, clientId, side, price, qty, eventTs, tif, account);
+        enterLimit(clientId, side, price, qty, eventTs, tif, account, OrderKind::PLAIN, 0);
+    }
+
+    // Iceberg (0 < displayQty < qty) or hidden (displayQty 0) limit order. It matches its
+    // whole size like any GFD limit; the remainder rests showing one displayQty slice at a
+    // time. Once a slice has traded away, the next comes out of the reserve and the order
+    // requeues at the tail of its level: O(1), same pool slot, new time priority. Hidden
+    // orders keep ordinary time priority and are never shown. displayQty >= qty is a plain limit.
+    void placeReserve(u64 clientId, Side side, Price price, i64 qty, i64 displayQty, u64 eventTs=0, uint8_t account=0) {
+        HFT_LAT_SCOPE(LatOp::PLACE_LIMIT);
+        if (displayQty > 0) journalCmd(CmdType::PEAK, clientId, side, price, displayQty, eventTs, TimeInForce::GFD, account);
+        journalCmd(CmdType::RESERVE, clientId, side, price, qty, eventTs, TimeInForce::GFD, account);
+        OrderKind k = displayQty <= 0 ? OrderKind::HIDDEN : displayQty < qty ? OrderKind::ICEBERG : OrderKind::PLAIN;
+        enterLimit(clientId, side, price, qty, eventTs, TimeInForce::GFD, account, k, displayQty);
     }
 
     // market order
-    void placeMarket(u64 clientId, Side side, i64 qty, TimePoint now) {
-        Order taker; taker.clientId = clientId; taker.side = side; taker.type = OrderType::MARKET; taker.priceIdx = -1; taker.qty = qty; taker.ts = (u64)chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
-        matchMarket(taker);
-    }
-
-    // cancel: removes order by clientId if present
-    bool cancel(u64 clientId) {
-        auto it = clientToEngine.find(clientId);
-        if (it==clientToEngine.end()) return false;
-        u64 eid = it->second;
-        Order &o = pool.get(eid);
-        if (!o.active) { clientToEngine.erase(it); return false; }
-        // find in ring level front... this is O(n) in level width - optimization: maintain position index per order
-        RingLevel &lvl = (o.side==Side::BUY)?book.bids[o.priceIdx]:book.asks[o.priceIdx];
-        // linear scan from head to tail to remove
-        size_t sz = lvl.data.size(); size_t pos = lvl.head; bool found=false; size_t idxpos=0;
-        while (pos != lvl.tail) {
-            if (lvl.data[pos]==eid) { found=true; break; }
-            pos = (pos+1)%sz; ++idxpos;
-        }
-        if (!found) { // maybe already matched
-            pool.free(eid); clientToEngine.erase(it); return false;
-        }
-        // remove by shifting items backwards (simple but O(k)). For demo it's acceptable.
-        size_t cur = pos; while (cur != (lvl.tail+sz-1)%sz) { size_t next = (cur+1)%sz; lvl.data[cur] = lvl.data[next]; cur = next; }
-        lvl.tail = (lvl.tail+sz-1)%sz; lvl.totalQty -= o.qty; pool.free(eid); clientToEngine.erase(it);
-        if (lvl.empty()) book.updateBestAfterRemove(o.side, o.priceIdx);
+    void placeMarket(u64 clientId, Side side, i64 qty, u64 eventTs=0, uint8_t account=0) {
+        HFT_LAT_SCOPE(LatOp::PLACE_MARKET);
+        journalCmd(CmdType::MARKET, clientId, side, -1, qty, eventTs, TimeInForce::GFD, account);
+        if (auction) { reject(clientId, side, 0, qty, account, eventTs, RejectReason::AUCTION_CALL); return; }
+        if (!validQty(qty)) { reject(clientId, side, 0, qty, account, eventTs, RejectReason::BAD_QTY); return; }
+        if (risk.cfg.enabled) if (RejectReason r = risk.checkMarket(qty); r != RejectReason::NONE) { reject(clientId, side, 0, qty, account, eventTs, r); return; }
+        Order taker; taker.clientId = clientId; taker.side = side; taker.type = OrderType::MARKET; taker.priceIdx = -1; taker.qty = qty; taker.ts = mdTs = clock.stamp(eventTs); taker.account = account;
+        report(ExecType::ACCEPTED, clientId, side, 0, qty, qty, account, taker.ts);
+        match(taker); endEvent();
+    }
+
+    // route one inbound command
+    void apply(const OrderCmd &c) {
+        switch (c.type) {
+        case CmdType::NEW:     placeLimit(c.clientId, c.side, c.price, c.qty, c.ts, c.tif, c.account); break;
+        case CmdType::MARKET:  placeMarket(c.clientId, c.side, c.qty, c.ts, c.account); break;
+        case CmdType::CANCEL:  cancel(c.clientId, c.ts); break;
+        case CmdType::REPLACE: replace(c.clientId, c.price, c.qty, c.ts); break;
+        case CmdType::AUCTION: beginAuction(); break;
+        case CmdType::UNCROSS: uncross(c.price < 0 ? -1 : priceToIdx(c.price), c.ts); break;
+        case CmdType::PEAK:    pendingPeak = c.qty; break;
+        case CmdType::RESERVE: placeReserve(c.clientId, c.side, c.price, c.qty, exchange(pendingPeak, 0), c.ts, c.account); break;
+        }
+    }
+
+    // Burst ingress. Orders are applied strictly in sequence; while order i is matched,
+    // the index entry of order i+2d and the records order i+d will touch (its resting
+    // order for cancel/replace, its price level, the pool slot a new order takes) are
+    // prefetched, d = PREFETCH_DIST. One clock read stamps the whole batch (TSC mode), its
+    // reports are committed to the sink together, and latency stats take one timing per
+    // batch (split evenly over its commands' op rows) instead of two clock reads per order.
+    void submitBatch(const OrderCmd *cmds, size_t n) {
+        HFT_LAT_ONLY(u64 b0 = readTsc(); inBatch = true; u64 perType[LatencyStats::CMD_TYPES] = {};)
+        clock.hold(); holdReports = true;
+        const size_t d = PREFETCH_DIST;
+        for (size_t i=0;i<n && i<2*d;i++) clientToEngine.prefetch(cmds[i].clientId);
+        for (size_t i=0;i<n && i<d;i++) prefetchTargets(cmds[i]);
+        for (size_t i=0;i<n;i++) {
+            if (i + 2*d < n) clientToEngine.prefetch(cmds[i + 2*d].clientId);
+            if (i + d < n) prefetchTargets(cmds[i + d]);
+            apply(cmds[i]);
+            HFT_LAT_ONLY(if ((int)cmds[i].type < LatencyStats::CMD_TYPES) ++perType[(int)cmds[i].type];)
+        }
+        clock.release(); holdReports = false; flushReports();
+        HFT_LAT_ONLY(inBatch = false; if (n) stats.recordBatch(readTsc() - b0, perType, n);)
+    }
+
+    // cancel: removes order by clientId if present (eventTs only stamps market-data deltas)
+    bool cancel(u64 clientId, u64 eventTs=0) {
+        HFT_LAT_SCOPE(LatOp::CANCEL);
+        journalCmd(CmdType::CANCEL, clientId, Side::BUY, -1, 0, eventTs);
+        u64 eid = clientToEngine.find(clientId);
+        if (eid==IdIndex::NONE) { reject(clientId, Side::BUY, 0, 0, 0, eventTs, RejectReason::UNKNOWN_ORDER); return false; }
+        ColdOrder &o = pool.cold(eid);
+        if (!o.active) { clientToEngine.erase(clientId); reject(clientId, Side::BUY, 0, 0, 0, eventTs, RejectReason::UNKNOWN_ORDER); return false; }
+        cancelResting(eid, o, eventTs); endEvent();
         return true;
     }
 
-    // replace: cancel & place new
-    bool replace(u64 clientId, int newPriceIdx, i64 newQty, TimePoint now) {
-        auto it = clientToEngine.find(clientId);
-        if (it==clientToEngine.end()) return false;
-        u64 oldEid = it->second; Order &old = pool.get(oldEid);
-        if (!old.active) return false;
-        // cancel existing
-        cancel(clientId);
-        // place new with same clientId
-        placeLimit(clientId, old.side, newPriceIdx, newQty, now, old.tif);
+    // replace: a same-price size-down is applied in place and keeps queue priority;
+    // a price change or size-up unlinks the order and re-enters it as a new taker
+    // (it may trade) that requeues at the tail in the same pool slot. With risk on, the
+    // re-entry is checked net of the old size; a reject leaves the order untouched.
+    bool replace(u64 clientId, Price newPrice, i64 newQty, u64 eventTs=0) {
+        HFT_LAT_SCOPE(LatOp::REPLACE);
+        journalCmd(CmdType::REPLACE, clientId, Side::BUY, newPrice, newQty, eventTs);
+        u64 eid = clientToEngine.find(clientId);
+        if (eid==IdIndex::NONE || !pool.cold(eid).active) { reject(clientId, Side::BUY, newPrice, newQty, 0, eventTs, RejectReason::UNKNOWN_ORDER); return false; }
+        ColdOrder &old = pool.cold(eid);
+        if (newQty <= 0) { cancelResting(eid, old, eventTs); endEvent(); return true; }
+        if (!validPrice(newPrice)) { reject(clientId, old.side, newPrice, newQty, old.account, eventTs, RejectReason::BAD_PRICE); return false; }
+        if (newQty > MAX_ORDER_QTY) { reject(clientId, old.side, newPrice, newQty, old.account, eventTs, RejectReason::BAD_QTY); return false; }
+        int newPriceIdx = priceToIdx(newPrice);
+        HotOrder &h = pool.hot(eid);
+        RingLevel &lvl = book.level(old.side, old.priceIdx);
+        if (newPriceIdx == old.priceIdx && newQty <= h.qty && old.kind == OrderKind::PLAIN) {
+            if (risk.cfg.enabled) risk.release(old.account, old.priceIdx, h.qty - newQty);
+            lvl.totalQty -= h.qty - newQty; h.qty = newQty; book.syncQty(old.side, old.priceIdx, lvl.totalQty);
+            u64 ts = md ? (mdTs = clock.stamp(eventTs)) : eventTs;
+            report(ExecType::ACCEPTED, clientId, old.side, newPrice, newQty, newQty, old.account, ts);
+            if (md) { mdTouch(old.side, old.priceIdx); flushMd(); }
+            endReports();
+            return true;
+        }
+        i64 oldQty = restingQty(eid, old); // reserve orders always re-enter, keeping their kind and slice size
+        if (risk.cfg.enabled) {
+            if (RejectReason r = risk.check(old.account, old.side, newPriceIdx, newQty, book.bestBid, book.bestAsk, oldQty, oldQty * (i64)idxToPrice(old.priceIdx)); r != RejectReason::NONE) {
+                reject(clientId, old.side, newPrice, newQty, old.account, eventTs, r); return false;
+            }
+            risk.release(old.account, old.priceIdx, oldQty);
+        }
+        unlinkResting(lvl, eid, old, oldQty); touched(old.side, old.priceIdx, lvl);
+        if (lvl.empty()) book.updateBestAfterRemove(old.side, old.priceIdx);
+        Order taker; taker.clientId = clientId; taker.side = old.side; taker.type = OrderType::LIMIT; taker.priceIdx = newPriceIdx; taker.qty = newQty; taker.ts = mdTs = clock.stamp(eventTs); taker.account = old.account;
+        taker.kind = old.kind; if (old.kind == OrderKind::ICEBERG) takerPeak = pool.res(eid).peak;
+        report(ExecType::ACCEPTED, clientId, taker.side, newPrice, newQty, newQty, taker.account, taker.ts);
+        if (auction) addPassive(taker, eid); else match(taker, eid);
+        endEvent();
         return true;
     }
 
+    // Opening / closing cross. During the call limit orders only rest (O(1) each, the
+    // book may cross), cancels and replaces work as usual, and market, IOC and FOK
+    // orders are rejected. uncross() finds the equilibrium price in one pass over the
+    // level totals, then fills the whole volume at that price in a single walk down
+    // both queues in price-time priority, so the book comes out uncrossed. Self-trade
+    // prevention does not apply to the cross.
+    void beginAuction() { journalCmd(CmdType::AUCTION, 0, Side::BUY, -1, 0, 0); auction = true; }
+    struct AuctionResult { int priceIdx = -1; i64 volume = 0, imbalance = 0; u64 trades = 0; };
+    AuctionResult uncross(int refIdx=-1, u64 eventTs=0) {
+        journalCmd(CmdType::UNCROSS, 0, Side::BUY, refIdx < 0 ? -1 : idxToPrice(refIdx), 0, eventTs);
+        auction = false;
+        OrderBook::Equilibrium eq = book.equilibrium(refIdx);
+        AuctionResult r{eq.priceIdx, eq.volume, eq.imbalance, 0};
+        if (!eq.volume) return r;
+        u64 ts = mdTs = clock.stamp(eventTs); Price px = idxToPrice(eq.priceIdx);
+        for (i64 left = eq.volume; left > 0; ++r.trades) {
+            int bt = book.bestBid, at = book.bestAsk;
+            RingLevel &bl = book.level(Side::BUY, bt), &al = book.level(Side::SELL, at);
+            u64 be = bl.front(), ae = al.front(); HotOrder &b = pool.hot(be), &a = pool.hot(ae);
+            const ColdOrder &bc = pool.cold(be), &ac = pool.cold(ae); u64 bid = bc.clientId, aid = ac.clientId;
+            if (b.next != NIL) pool.prefetch(b.next); // the queue is walked in order; pull in who is next
+            if (a.next != NIL) pool.prefetch(a.next);
+            i64 fill = min(min(b.qty, a.qty), left);
+            if (risk.cfg.enabled) { risk.release(bc.account, bt, fill); risk.release(ac.account, at, fill); }
+            b.qty -= fill; a.qty -= fill; bl.totalQty -= fill; al.totalQty -= fill; left -= fill;
+            i64 bLeft = bc.kind == OrderKind::PLAIN ? b.qty : reserveFilled(bl, be, bc, fill), aLeft = ac.kind == OrderKind::PLAIN ? a.qty : reserveFilled(al, ae, ac, fill);
+            report(bLeft ? ExecType::PARTIAL_FILL : ExecType::FILLED, bid, Side::BUY, px, fill, bLeft, bc.account, ts, RejectReason::NONE, aid, Liquidity::AUCTION);
+            report(aLeft ? ExecType::PARTIAL_FILL : ExecType::FILLED, aid, Side::SELL, px, fill, aLeft, ac.account, ts, RejectReason::NONE, bid, Liquidity::AUCTION);
+            ++tradeCount; touched(Side::BUY, bt, bl); touched(Side::SELL, at, al);
+            if (!bLeft) { bl.pop_front(pool, 0); pool.free(be); clientToEngine.erase(bid); if (bl.empty()) book.updateBestAfterRemove(Side::BUY, bt); }
+            if (!aLeft) { al.pop_front(pool, 0); pool.free(ae); clientToEngine.erase(aid); if (al.empty()) book.updateBestAfterRemove(Side::SELL, at); }
+        }
+        endEvent();
+        return r;
+    }
+
 private:
-    void emitTrade(const Order &taker, const Order &maker, i64 qty, int priceIdx) {
-        Trade tr{taker.clientId, maker.clientId, qty, priceIdx, (u64)chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now().time_since_epoch()).count() };
-        trades.push_back(tr);
-    }
-
-    void matchAndAdd(Order &taker) {
-        if (taker.side==Side::BUY) {
-            // match against asks with price <= taker.priceIdx
-            while (taker.qty>0 && book.bestAsk!=-1 && book.bestAsk <= taker.priceIdx) {
-                RingLevel &pl = book.asks[book.bestAsk]; if (pl.empty()) { book.updateBestAfterRemove(Side::SELL, book.bestAsk); continue; }
-                u64 makerEid = pl.front(); Order &maker = pool.get(makerEid);
-                i64 fill = min(maker.qty, taker.qty);
-                emitTrade(taker, maker, fill, maker.priceIdx);
-                maker.qty -= fill; pl.totalQty -= fill; taker.qty -= fill;
-                if (maker.qty==0) { pl.pop_front(0); pool.free(makerEid); clientToEngine.erase(maker.clientId); }
-                if (pl.empty()) book.updateBestAfterRemove(Side::SELL, book.bestAsk);
-            }
-            if (taker.qty>0 && taker.type==OrderType::LIMIT) {
-                // add passive
-                u64 eid = pool.allocate(taker); book.bids[taker.priceIdx].push(eid, taker.qty); book.updateBestAfterAdd(Side::BUY, taker.priceIdx); clientToEngine[taker.clientId]=eid;
-            }
-        } else {
-            while (taker.qty>0 && book.bestBid!=-1 && book.bestBid >= taker.priceIdx) {
-                RingLevel &pl = book.bids[book.bestBid]; if (pl.empty()) { book.updateBestAfterRemove(Side::BUY, book.bestBid); continue; }
-                u64 makerEid = pl.front(); Order &maker = pool.get(makerEid);
-                i64 fill = min(maker.qty, taker.qty);
-                emitTrade(taker, maker, fill, maker.priceIdx);
-                maker.qty -= fill; pl.totalQty -= fill; taker.qty -= fill;
-                if (maker.qty==0) { pl.pop_front(0); pool.free(makerEid); clientToEngine.erase(maker.clientId); }
-                if (pl.empty()) book.updateBestAfterRemove(Side::BUY, book.bestBid);
-            }
-            if (taker.qty>0 && taker.type==OrderType::LIMIT) {
-                u64 eid = pool.allocate(taker); book.asks[taker.priceIdx].push(eid, taker.qty); book.updateBestAfterAdd(Side::SELL, taker.priceIdx); clientToEngine[taker.clientId]=eid;
-            }
+    // second prefetch stage; the index entry should already be in cache
+    inline void prefetchTargets(const OrderCmd &c) {
+        switch (c.type) {
+        case CmdType::NEW: case CmdType::RESERVE: book.prefetch(c.side, priceToIdx(c.price)); pool.prefetchNextFree(); break;
+        case CmdType::MARKET: case CmdType::AUCTION: case CmdType::UNCROSS: case CmdType::PEAK: break; // MARKET sweeps the opposite best, which is hot anyway
+        case CmdType::CANCEL: case CmdType::REPLACE: {
+            u64 eid = clientToEngine.find(c.clientId);
+            if (eid != IdIndex::NONE) pool.prefetch(eid); // its level needs the cold record first; not worth the stall
+        } break;
+        }
+    }
+
+    // every public entry point logs its command as received, before any check, so a
+    // replay makes the same decisions (rejects included)
+    inline void journalCmd(CmdType t, u64 clientId, Side s, Price px, i64 qty, u64 ts, TimeInForce tif=TimeInForce::GFD, uint8_t account=0) {
+        if (!journal) return;
+        OrderCmd c; c.type = t; c.clientId = clientId; c.side = s; c.price = cmdPrice(px); c.qty = cmdQty(qty); c.ts = ts; c.tif = tif; c.account = account; c.symbol = symbol;
+        journal->append(c);
+    }
+
+    // what a resting order still has: its queued qty plus an iceberg's reserve
+    inline i64 restingQty(u64 eid, const ColdOrder &o) { return pool.hot(eid).qty + (o.kind == OrderKind::ICEBERG ? pool.res(eid).reserve : 0); }
+    // take a resting order (q = restingQty) off its level, hidden totals included
+    inline void unlinkResting(RingLevel &lvl, u64 eid, const ColdOrder &o, i64 q) {
+        lvl.erase(pool, eid, q);
+        if (o.kind == OrderKind::ICEBERG) lvl.hiddenQty -= pool.res(eid).reserve;
+        else if (o.kind == OrderKind::HIDDEN) { lvl.hiddenQty -= q; --lvl.hiddenCount; }
+    }
+
+    void removeResting(u64 eid, const ColdOrder &o) {
+        RingLevel &lvl = book.level(o.side, o.priceIdx); i64 q = restingQty(eid, o);
+        if (risk.cfg.enabled) risk.release(o.account, o.priceIdx, q);
+        unlinkResting(lvl, eid, o, q); pool.free(eid);
+        if (o.kind == OrderKind::HIDDEN) book.syncQty(o.side, o.priceIdx, lvl.totalQty); else touched(o.side, o.priceIdx, lvl);
+        if (lvl.empty()) book.updateBestAfterRemove(o.side, o.priceIdx);
+    }
+
+    // a cancel or a replace to zero: report, then unlink (mdTs is only stamped for the feed)
+    void cancelResting(u64 eid, const ColdOrder &o, u64 eventTs) {
+        u64 ts = md ? (mdTs = clock.stamp(eventTs)) : eventTs;
+        report(ExecType::CANCELLED, o.clientId, o.side, idxToPrice(o.priceIdx), restingQty(eid, o), 0, o.account, ts);
+        u64 clientId = o.clientId; removeResting(eid, o); clientToEngine.erase(clientId);
+    }
+
+    // one report, written field by field into the sink's current run
+    __attribute__((always_inline)) inline void report(ExecType t, u64 clientId, Side s, Price px, i64 qty, i64 leaves, uint8_t account, u64 ts,
+                       RejectReason why=RejectReason::NONE, u64 counterparty=0, Liquidity liq=Liquidity::NONE) {
+        if (rep == repEnd) nextRun();
+        ExecReport &r = *rep++;
+        r.seq = ++reportSeq; r.clientId = clientId; r.counterparty = counterparty; r.ts = ts; r.qty = qty; r.leaves = leaves;
+        r.price = (int32_t)px; r.symbol = symbol; r.type = t; r.side = s; r.reason = why; r.account = account; r.liquidity = liq;
+    }
+    __attribute__((noinline)) void nextRun() {
+        if (rep != repBase) sink->commit((size_t)(rep - repBase));
+        size_t n; repBase = rep = sink->reserve(n); repEnd = rep + n;
+    }
+    inline void flushReports() { if (rep != repBase) sink->commit((size_t)(rep - repBase)); rep = repBase = repEnd = nullptr; }
+    inline void endReports() { if (!holdReports) flushReports(); }
+    void reject(u64 clientId, Side s, Price px, i64 qty, uint8_t account, u64 ts, RejectReason why) {
+        report(ExecType::REJECTED, clientId, s, cmdPrice(px), qty, 0, account, ts, why); endReports();
+    }
+    // both sides of one trade; leaves are what each side has left after it
+    __attribute__((always_inline)) inline void emitFill(const Order &taker, const ColdOrder &mc, i64 makerLeaves, i64 qty, int priceIdx) {
+        Price px = idxToPrice(priceIdx);
+        report(taker.qty ? ExecType::PARTIAL_FILL : ExecType::FILLED, taker.clientId, taker.side, px, qty, taker.qty, taker.account, taker.ts, RejectReason::NONE, mc.clientId, Liquidity::TAKER);
+        report(makerLeaves ? ExecType::PARTIAL_FILL : ExecType::FILLED, mc.clientId, mc.side, px, qty, makerLeaves, mc.account, taker.ts, RejectReason::NONE, taker.clientId, Liquidity::MAKER);
+        ++tradeCount;
+    }
+    inline Price takerPx(const Order &t) const { return t.priceIdx >= 0 ? idxToPrice(t.priceIdx) : 0; }
+    // taker size that leaves without trading or resting
+    inline void cancelTaker(Order &t, RejectReason why=RejectReason::NONE) { report(ExecType::CANCELLED, t.clientId, t.side, takerPx(t), t.qty, 0, t.account, t.ts, why); t.qty = 0; }
+    inline void mdTouch(Side s, int idx) { if (md && md->touch(s, idx)) md->flush(book, symbol, mdTs); }
+    // every change to a level's totalQty goes through here (or syncQty + mdTouch)
+    inline void touched(Side s, int idx, const RingLevel &l) { book.syncQty(s, idx, l.totalQty); mdTouch(s, idx); }
+    inline void flushMd() { if (md) md->publish(book, symbol, mdTs); }
+    inline void endEvent() { endReports(); flushMd(); book.recenter(); }
+
+    // checks, stamp, ack, then match (or rest, during an auction call) a limit of any kind
+    __attribute__((always_inline)) inline void enterLimit(u64 clientId, Side side, Price price, i64 qty, u64 eventTs, TimeInForce tif, uint8_t account, OrderKind kind, i64 peak) {
+        if (!validPrice(price)) { reject(clientId, side, price, qty, account, eventTs, RejectReason::BAD_PRICE); return; }
+        if (!validQty(qty)) { reject(clientId, side, price, qty, account, eventTs, RejectReason::BAD_QTY); return; }
+        int priceIdx = priceToIdx(price);
+        if (risk.cfg.enabled) if (RejectReason r = risk.check(account, side, priceIdx, qty, book.bestBid, book.bestAsk); r != RejectReason::NONE) { reject(clientId, side, price, qty, account, eventTs, r); return; }
+        if (auction && tif != TimeInForce::GFD) { reject(clientId, side, price, qty, account, eventTs, RejectReason::AUCTION_CALL); return; }
+        Order taker; taker.clientId = clientId; taker.side = side; taker.type = OrderType::LIMIT; taker.priceIdx = priceIdx; taker.qty = qty; taker.ts = mdTs = clock.stamp(eventTs); taker.tif = tif; taker.account = account;
+        taker.kind = kind; takerPeak = peak;
+        report(ExecType::ACCEPTED, clientId, side, price, qty, qty, account, taker.ts);
+        if (auction) addPassive(taker, IdIndex::NONE); else match(taker);
+        endEvent();
+    }
+
+    // slot != NONE: taker is a replaced order that still owns that pool slot and index entry
+    // a new order the pool cannot take is dropped unrested (counted in pool.rejected)
+    void addPassive(Order &taker, u64 slot) {
+        u64 eid = slot;
+        if (slot == IdIndex::NONE) { if ((eid = pool.allocate(taker)) == OrderPool::NONE) { cancelTaker(taker, RejectReason::POOL_FULL); return; } clientToEngine.insert(taker.clientId, eid); }
+        else pool.assign(slot, taker);
+        if (risk.cfg.enabled) risk.rest(taker.account, taker.priceIdx, taker.qty);
+        book.anchor(taker.priceIdx);
+        RingLevel &lvl = book.level(taker.side, taker.priceIdx);
+        lvl.push(pool, eid, taker.qty);
+        if (taker.kind != OrderKind::PLAIN) restReserve(taker, eid, lvl); else touched(taker.side, taker.priceIdx, lvl);
+        book.updateBestAfterAdd(taker.side, taker.priceIdx);
+    }
+    // a reserve order just pushed with its whole size: an iceberg keeps one slice in the
+    // queue and the rest in its reserve record; a hidden order is all hidden, and since
+    // nothing shown changed, market data is not touched
+    void restReserve(const Order &t, u64 eid, RingLevel &lvl) {
+        if (t.kind == OrderKind::ICEBERG) {
+            i64 slice = min(takerPeak, t.qty);
+            pool.hot(eid).qty = slice; pool.setReserve(eid, t.qty - slice, takerPeak); lvl.hiddenQty += t.qty - slice;
+            touched(t.side, t.priceIdx, lvl);
+        } else { lvl.hiddenQty += t.qty; ++lvl.hiddenCount; book.syncQty(t.side, t.priceIdx, lvl.totalQty); }
+    }
+    // a reserve order at the head of l traded `fill` (already off its qty and l.totalQty):
+    // keep the hidden totals in step and, when an iceberg's slice is gone, move the next
+    // out of the reserve and requeue it at the tail. Returns its leaves (0: remove it).
+    i64 reserveFilled(RingLevel &l, u64 eid, const ColdOrder &c, i64 fill) {
+        HotOrder &h = pool.hot(eid);
+        if (c.kind == OrderKind::HIDDEN) { l.hiddenQty -= fill; if (!h.qty) --l.hiddenCount; return h.qty; }
+        ReserveOrder &r = pool.res(eid);
+        if (!h.qty && r.reserve) { i64 slice = min(r.peak, r.reserve); r.reserve -= slice; h.qty = slice; l.hiddenQty -= slice; l.requeue(pool, eid); }
+        return h.qty + r.reserve;
+    }
+
+    // one dispatch per inbound order; new order types get a case here and a crosses<> rule
+    void match(Order &taker, u64 slot=IdIndex::NONE) {
+        switch ((int(taker.type) << 1) | int(taker.side)) {
+        case (int(OrderType::LIMIT)  << 1) | int(Side::BUY):  sweep<Side::BUY,  OrderType::LIMIT>(taker, slot);  break;
+        case (int(OrderType::LIMIT)  << 1) | int(Side::SELL): sweep<Side::SELL, OrderType::LIMIT>(taker, slot);  break;
+        case (int(OrderType::MARKET) << 1) | int(Side::BUY):  sweep<Side::BUY,  OrderType::MARKET>(taker, slot); break;
+        case (int(OrderType::MARKET) << 1) | int(Side::SELL): sweep<Side::SELL, OrderType::MARKET>(taker, slot); break;
         }
     }
 
-    void matchMarket(Order &taker) {
-        if (taker.side==Side::BUY) {
-            while (taker.qty>0 && book.bestAsk!=-1) {
-                RingLevel &pl = book.asks[book.bestAsk]; if (pl.empty()) { book.updateBestAfterRemove(Side::SELL, book.bestAsk); continue; }
-                u64 makerEid = pl.front(); Order &maker = pool.get(makerEid);
-                i64 fill = min(maker.qty, taker.qty);
-                emitTrade(taker, maker, fill, maker.priceIdx);
-                maker.qty -= fill; pl.totalQty -= fill; taker.qty -= fill;
-                if (maker.qty==0) { pl.pop_front(0); pool.free(makerEid); clientToEngine.erase(maker.clientId); }
-                if (pl.empty()) book.updateBestAfterRemove(Side::SELL, book.bestAsk);
+    // can a taker of side S / type T trade against the opposite best level?
+    template<Side S, OrderType T> static inline bool crosses(int best, int limitIdx) {
+        if constexpr (T==OrderType::MARKET) return true;
+        else if constexpr (S==Side::BUY) return best <= limitIdx;
+        else return best >= limitIdx;
+    }
+
+    // sweep the opposite side while it crosses, then rest a GFD limit remainder
+    // (IOC drops it; FOK never gets here unless it fills completely). With STP on, a maker
+    // of the taker's own account is cancelled (CANCEL_RESTING, the sweep goes on) or ends
+    // the sweep and drops the taker's remainder (CANCEL_TAKER). The FOK check counts own
+    // size as fillable, so under STP an FOK can come up short; its remainder is dropped.
+    template<Side S, OrderType T> void sweep(Order &taker, u64 slot) {
+        constexpr Side M = S==Side::BUY ? Side::SELL : Side::BUY; // maker side
+        int &best = S==Side::BUY ? book.bestAsk : book.bestBid;
+        if constexpr (T==OrderType::LIMIT) {
+            if (taker.tif==TimeInForce::FOK && !book.canFill(S, taker.priceIdx, taker.qty)) { cancelTaker(taker); return; } // all-or-nothing
+        }
+        HFT_LAT_ONLY(int lastLevel = -1;)
+        while (taker.qty>0 && best!=-1 && crosses<S,T>(best, taker.priceIdx)) {
+            HFT_LAT_ONLY(if (best != lastLevel) { lastLevel = best; ++sweptLevels; })
+            RingLevel &pl = book.level(M, best);
+            u64 makerEid = pl.front(); HotOrder &maker = pool.hot(makerEid);
+            const ColdOrder &mc = pool.cold(makerEid); u64 makerClient = mc.clientId;
+            if (risk.cfg.enabled && mc.account == taker.account && risk.cfg.stp != StpMode::NONE) {
+                ++risk.stpCancels;
+                if (risk.cfg.stp == StpMode::CANCEL_TAKER) { cancelTaker(taker, RejectReason::SELF_TRADE); break; }
+                i64 q = restingQty(makerEid, mc);
+                report(ExecType::CANCELLED, makerClient, M, idxToPrice(best), q, 0, mc.account, taker.ts, RejectReason::SELF_TRADE);
+                risk.release(mc.account, best, q);
+                unlinkResting(pl, makerEid, mc, q); pool.free(makerEid); clientToEngine.erase(makerClient); touched(M, best, pl);
+                if (pl.empty()) book.updateBestAfterRemove(M, best);
+                continue;
             }
-        } else {
-            while (taker.qty>0 && book.bestBid!=-1) {
-                RingLevel &pl = book.bids[book.bestBid]; if (pl.empty()) { book.updateBestAfterRemove(Side::BUY, book.bestBid); continue; }
-                u64 makerEid = pl.front(); Order &maker = pool.get(makerEid);
-                i64 fill = min(maker.qty, taker.qty);
-                emitTrade(taker, maker, fill, maker.priceIdx);
-                maker.qty -= fill; pl.totalQty -= fill; taker.qty -= fill;
-                if (maker.qty==0) { pl.pop_front(0); pool.free(makerEid); clientToEngine.erase(maker.clientId); }
-                if (pl.empty()) book.updateBestAfterRemove(Side::BUY, book.bestBid);
+            i64 fill = min(maker.qty, taker.qty);
+            if (risk.cfg.enabled) risk.release(mc.account, best, fill);
+            maker.qty -= fill; pl.totalQty -= fill; taker.qty -= fill;
+            i64 leaves = mc.kind == OrderKind::PLAIN ? maker.qty : reserveFilled(pl, makerEid, mc, fill);
+            emitFill(taker, mc, leaves, fill, best); touched(M, best, pl);
+            if (leaves==0) {
+                pl.pop_front(pool, 0); pool.free(makerEid); clientToEngine.erase(makerClient);
+                if (pl.empty()) book.updateBestAfterRemove(M, best);
             }
         }
+        if constexpr (T==OrderType::LIMIT) {
+            if (taker.qty>0 && taker.tif==TimeInForce::GFD) { addPassive(taker, slot); return; }
+        }
+        if (taker.qty>0) cancelTaker(taker); // IOC / market remainder
+        if (slot != IdIndex::NONE) { pool.free(slot); clientToEngine.erase(taker.clientId); } // replaced order fully filled
+    }
+};
+
+using Engine = BasicEngine<>;
+
+// ------------------------------ REPORT SINKS -----------------------------
+// Fixed-size ring consumer; the engine writes reports straight into its slots.
+// BLOCK waits (per WaitMode) for a consumer on another thread to drain it; DROP
+// keeps the first `capacity` unread reports and counts the rest.
+enum class OverflowPolicy : uint8_t { BLOCK = 0, DROP = 1 };
+struct RingReportSink : ReportSink {
+    static constexpr size_t WANT = 64; // re-read the consumer's index once fewer slots than this look free
+    SpscRing<ExecReport> ring; OverflowPolicy policy; WaitMode waitMode; u64 dropped = 0;
+    NullReportSink spill; bool spilling = false; // DROP: the run handed out while full
+    RingReportSink(size_t cap, OverflowPolicy p=OverflowPolicy::BLOCK, WaitMode w=WaitMode::BACKOFF):ring(cap), policy(p), waitMode(w) {}
+    ExecReport *reserve(size_t &n) override {
+        ExecReport *r = ring.claim(n, WANT);
+        if (n) { spilling = false; return r; }
+        if (policy==OverflowPolicy::DROP) { spilling = true; return spill.reserve(n); }
+        Waiter w(waitMode); while (!(r = ring.claim(n, WANT), n)) w.idle();
+        spilling = false; return r;
+    }
+    void commit(size_t n) override { if (spilling) dropped += n; else ring.publish(n); }
+    bool poll(ExecReport &r) { return ring.tryPop(r); }
+    template<class F> size_t consume(F &&f) { return ring.consume(f); } // f(const ExecReport&) in place
+};
+
+#ifdef __unix__
+// Append-only binary report log: the engine writes ExecReport records directly into
+// a MAP_SHARED window. The file grows `chunkBytes` at a time (ftruncate + remap,
+// once per chunk), and is truncated to the exact record count on close.
+struct MmapReportWriter : ReportSink {
+    int fd = -1; char *map = nullptr; size_t mapped = 0, used = 0, chunk;
+    MmapReportWriter(const string &path, size_t chunkBytes=64u<<20):chunk(max(chunkBytes - chunkBytes % sizeof(ExecReport), sizeof(ExecReport))) {
+        fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0) throw runtime_error("cannot open report log " + path);
+        grow();
+    }
+    ~MmapReportWriter() { close(); }
+    ExecReport *reserve(size_t &n) override {
+        if (used == mapped) grow();
+        n = (mapped - used) / sizeof(ExecReport); return (ExecReport*)(map + used);
+    }
+    void commit(size_t n) override { used += n * sizeof(ExecReport); }
+    void close() {
+        if (fd < 0) return;
+        if (map) munmap(map, mapped);
+        if (ftruncate(fd, (off_t)used) != 0) {}
+        ::close(fd); fd = -1; map = nullptr;
+    }
+    size_t records() const { return used / sizeof(ExecReport); }
+private:
+    void grow() {
+        if (map) munmap(map, mapped);
+        mapped += chunk;
+        if (ftruncate(fd, (off_t)mapped) != 0) throw runtime_error("report log ftruncate failed");
+        void *p = mmap(nullptr, mapped, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) throw runtime_error("report log mmap failed");
+        map = (char*)p;
+    }
+};
+#endif
+
+// ---------------------------- MATCHING THREAD ----------------------------
+// Ingress ring -> pinned matching thread -> report ring. The producer blocks
+// (per its WaitMode) when ingress is full; the matcher blocks when reports are.
+// A producer that also consumes the reports must drain them while it waits (submit
+// with a drain, or trySubmit); otherwise each side waits for the other forever.
+template<class EngineT = Engine>
+struct MatchingThread {
+    EngineT &engine;
+    SpscRing<OrderCmd> in;
+    RingReportSink out;
+    WaitMode waitMode; ThreadPolicy policy;
+    ThreadPolicyStatus applied; // what the OS granted the thread; read after stop()
+    atomic<bool> running{false};
+    atomic<u64> processed{0};
+    thread th;
+    MatchingThread(EngineT &e, size_t inCap=1<<16, size_t outCap=1<<18, WaitMode w=WaitMode::BACKOFF, int pinCore=-1)
+        :engine(e), in(inCap), out(outCap, OverflowPolicy::BLOCK, w), waitMode(w) { policy.core = pinCore; }
+    MatchingThread(EngineT &e, size_t inCap, size_t outCap, WaitMode w, const ThreadPolicy &p)
+        :engine(e), in(inCap), out(outCap, OverflowPolicy::BLOCK, w), waitMode(w), policy(p) {}
+    ~MatchingThread() { stop(); }
+    void start() { engine.setSink(&out); running.store(true); th = thread([this]{ run(); }); }
+    void stop() { if (th.joinable()) { running.store(false, memory_order_release); th.join(); } }
+    // producer side; submit(c) alone is for when another thread consumes the reports
+    bool trySubmit(const OrderCmd &c) { return in.tryPush(c); }
+    void submit(const OrderCmd &c) { Waiter w(waitMode); while (!in.tryPush(c)) w.idle(); }
+    // waits for ingress room while passing reports to drain(const ExecReport&)
+    template<class F> void submit(const OrderCmd &c, F &&drain) { Waiter w(waitMode); while (!in.tryPush(c)) { if (out.consume(drain)) w.reset(); else w.idle(); } }
+    // report consumer side: f(const ExecReport&) on everything committed so far, in place
+    template<class F> size_t pollReports(F &&f) { return out.consume(f); }
+private:
+    // drains the ingress ring in bursts through Engine::submitBatch
+    static constexpr size_t BURST = 64;
+    void run() {
+        applied = applyThreadPolicy(policy); NoAllocScope guard(policy.noAlloc);
+        Waiter w(waitMode); OrderCmd burst[BURST]; u64 n = 0;
+        for (;;) {
+            if (size_t k = in.tryPopBatch(burst, BURST)) {
+                w.reset(); engine.submitBatch(burst, k); processed.store(n += k, memory_order_release);
+            } else if (!running.load(memory_order_acquire)) {
+                if (in.empty()) break;
+            } else w.idle();
+        }
     }
 };
 
-// ------------------------------- PRICE MAPPING ---------------------------
-struct PriceMapper { double tick; double minP; int levels; PriceMapper(double t,double m,int l):tick(t),minP(m),levels(l){}
-    inline int priceToIdx(double price) const { int idx = int(round((price - minP) / tick)); if (idx<0) idx=0; if (idx>=levels) idx=levels-1; return idx; }
+// ----------------------------- SHARDED ENGINE ----------------------------
+// N shards, each a pinned thread owning the Engines (one per symbol) for the
+// symbols with symbol % N == shard. Engines are constructed on the shard thread
+// after pinning so first-touch places pool and book pages on that core's NUMA node.
+// Order ids carry their symbol: id = symbol << SYMBOL_SHIFT | per-symbol sequence,
+// so cancels/replaces find the owning shard from the id alone; the shard's Engine
+// sees only the dense sequence part (report ids are local, qualified by ExecReport::symbol).
+// A shard waits for room in its report ring, so a producer that is also the report
+// consumer must set drainWhileWaiting; otherwise both can end up waiting on each other.
+struct ShardedEngine {
+    static constexpr int SYMBOL_SHIFT = 40;
+    static constexpr u64 LOCAL_MASK = (1ull << SYMBOL_SHIFT) - 1;
+    static inline uint32_t symbolOf(u64 id) { return (uint32_t)(id >> SYMBOL_SHIFT); }
+    static inline u64 globalId(uint32_t symbol, u64 local) { return ((u64)symbol << SYMBOL_SHIFT) | local; }
+
+    struct Shard {
+        SpscRing<OrderCmd> in;
+        RingReportSink out; // shared by the shard's Engines
+        atomic<bool> running{false}, ready{false};
+        atomic<u64> processed{0};
+        thread th;
+        Shard(size_t inCap, size_t outCap, WaitMode w):in(inCap), out(outCap, OverflowPolicy::BLOCK, w) {}
+    };
+    int nShards; uint32_t nSymbols; EngineConfig perSymbol; WaitMode waitMode;
+    vector<unique_ptr<Shard>> shards;
+    vector<u64> nextSeq; // producer-side per-symbol id sequence
+    size_t submitted = 0;
+    void (*drainFn)(void*, const ExecReport&) = nullptr; void *drainCtx = nullptr;
+
+    ShardedEngine(int n, uint32_t symbols, const EngineConfig &cfg, vector<int> cores={}, WaitMode w=WaitMode::BACKOFF, size_t inCap=1<<16, size_t outCap=1<<16)
+        :nShards(n), nSymbols(symbols), perSymbol(cfg), waitMode(w), nextSeq(symbols, 1) {
+        for (int i=0;i<n;i++) shards.emplace_back(new Shard(inCap, outCap, w));
+        for (int i=0;i<n;i++) {
+            Shard &sh = *shards[i]; int core = i < (int)cores.size() ? cores[i] : -1;
+            sh.running.store(true); sh.th = thread([this, &sh, i, core]{ run(sh, i, core); });
+        }
+        for (auto &sh : shards) while (!sh->ready.load(memory_order_acquire)) this_thread::yield();
+    }
+    ~ShardedEngine() { stop(); }
+    void stop() { for (auto &sh : shards) if (sh->th.joinable()) { sh->running.store(false, memory_order_release); sh->th.join(); } }
+
+    inline int shardOf(uint32_t symbol) const { return (int)(symbol % (uint32_t)nShards); }
+    inline void checkSymbol(uint32_t symbol) const { if (symbol >= nSymbols) throw runtime_error("unknown symbol"); }
+
+    // producer API (single producer thread); an unknown symbol throws before anything is touched
+    u64 placeLimit(uint32_t symbol, Side side, Price price, i64 qty, TimeInForce tif=TimeInForce::GFD, u64 ts=0) {
+        checkSymbol(symbol); OrderCmd c; c.type = CmdType::NEW; c.symbol = symbol; c.side = side; c.price = cmdPrice(price); c.qty = cmdQty(qty); c.tif = tif; c.ts = ts;
+        u64 local = nextSeq[symbol]++; c.clientId = local; push(c); return globalId(symbol, local);
+    }
+    void placeMarket(uint32_t symbol, Side side, i64 qty, u64 ts=0) {
+        checkSymbol(symbol); OrderCmd c; c.type = CmdType::MARKET; c.symbol = symbol; c.side = side; c.qty = cmdQty(qty); c.ts = ts; c.clientId = nextSeq[symbol]++; push(c);
+    }
+    void cancel(u64 id) { checkSymbol(symbolOf(id)); OrderCmd c; c.type = CmdType::CANCEL; c.symbol = symbolOf(id); c.clientId = id & LOCAL_MASK; push(c); }
+    void replace(u64 id, Price newPrice, i64 newQty, u64 ts=0) {
+        checkSymbol(symbolOf(id)); OrderCmd c; c.type = CmdType::REPLACE; c.symbol = symbolOf(id); c.clientId = id & LOCAL_MASK; c.price = cmdPrice(newPrice); c.qty = cmdQty(newQty); c.ts = ts; push(c);
+    }
+    // drain reports from every shard in place; returns how many were handed to f
+    template<class F> size_t pollReports(F &&f) {
+        size_t n = 0;
+        for (auto &sh : shards) n += sh->out.consume(f);
+        return n;
+    }
+    u64 processed() const { u64 n = 0; for (auto &sh : shards) n += sh->processed.load(memory_order_acquire); return n; }
+    // f(const ExecReport&) gets the reports the producer drains while a shard's ingress is
+    // full; f must outlive the calls that push
+    template<class F> void drainWhileWaiting(F &f) { drainCtx = &f; drainFn = [](void *ctx, const ExecReport &r) { (*(F*)ctx)(r); }; }
+
+private:
+    void push(const OrderCmd &c) {
+        Shard &sh = *shards[shardOf(c.symbol)]; Waiter w(waitMode);
+        while (!sh.in.tryPush(c)) {
+            if (drainFn && pollReports([this](const ExecReport &r) { drainFn(drainCtx, r); })) w.reset(); else w.idle();
+        }
+        ++submitted;
+    }
+    void run(Shard &sh, int idx, int core) {
+        pinThread(core);
+        vector<unique_ptr<Engine>> books; // local slot = symbol / nShards
+        for (uint32_t s = idx; s < nSymbols; s += nShards) { EngineConfig cfg = perSymbol; cfg.symbol = s; books.emplace_back(new Engine(cfg)); books.back()->setSink(&sh.out); }
+        sh.ready.store(true, memory_order_release);
+        Waiter w(waitMode); OrderCmd c; u64 n = 0;
+        for (;;) {
+            if (sh.in.tryPop(c)) {
+                w.reset(); books[c.symbol / nShards]->apply(c); sh.processed.store(++n, memory_order_release);
+            } else if (!sh.running.load(memory_order_acquire)) {
+                if (sh.in.empty()) break;
+            } else w.idle();
+        }
+    }
 };
 
 // ------------------------------- WORKLOAD --------------------------------
+// Limit prices are drawn directly in ticks, uniformly over [lo, hi].
 struct WorkloadGen {
     mt19937_64 rng;
-    uniform_real_distribution<double> priceDist;
+    uniform_int_distribution<Price> priceDist;
     uniform_int_distribution<int> qtyDist;
     bernoulli_distribution marketProb;
     bernoulli_distribution sideProb;
-    PriceMapper pm;
-    WorkloadGen(uint64_t seed, PriceMapper mapper, double lo, double hi):rng(seed),priceDist(lo,hi),qtyDist(1,100),marketProb(0.03),sideProb(0.5),pm(mapper){}
-    tuple<OrderType,Side,int,i64> next() {
+    WorkloadGen(uint64_t seed, Price lo, Price hi):rng(seed),priceDist(lo,hi),qtyDist(1,100),marketProb(0.03),sideProb(0.5){}
+    tuple<OrderType,Side,Price,i64> next() {
         bool isMarket = marketProb(rng);
         Side s = sideProb(rng)?Side::BUY:Side::SELL;
         i64 qty = qtyDist(rng);
         if (isMarket) return {OrderType::MARKET,s,-1,qty};
-        double p = priceDist(rng); int pidx = pm.priceToIdx(p); return {OrderType::LIMIT,s,pidx,qty};
+        return {OrderType::LIMIT,s,priceDist(rng),qty};
     }
 };
+static constexpr Price DEMO_LO = 49 * TICKS_PER_UNIT, DEMO_MID = 50 * TICKS_PER_UNIT, DEMO_HI = 51 * TICKS_PER_UNIT;
 
-// ------------------------------- DEMO MAIN -------------------------------
-int main(){
-    ios::sync_with_stdio(false); cin.tie(nullptr);
-    PriceMapper pm(TICK, MIN_PRICE, PRICE_LEVELS);
-    Engine engine;
+// xoshiro256** (Blackman & Vigna): 32 bytes of state, a couple of ns per draw.
+struct Xoshiro256 {
+    u64 s[4];
+    explicit Xoshiro256(u64 seed) { for (u64 &w : s) { u64 z = (seed += 0x9E3779B97F4A7C15ull); z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull; z = (z ^ (z >> 27)) * 0x94D049BB133111EBull; w = z ^ (z >> 31); } } // splitmix64 seeding
+    static inline u64 rotl(u64 x, int k) { return (x << k) | (x >> (64 - k)); }
+    inline u64 next() {
+        u64 r = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+        s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3]; s[2] ^= t; s[3] = rotl(s[3], 45);
+        return r;
+    }
+    inline double uniform() { return (double)(next() >> 11) * 0x1.0p-53; }                  // [0, 1)
+    inline u64 below(u64 n) { return (u64)(((unsigned __int128)next() * n) >> 64); }        // [0, n)
+    inline bool chance(double p) { return uniform() < p; }
+};
+
+// Synthetic order flow shaped like a lit book's:
+// - limit prices sit a geometric number of ticks behind a mid that random-walks, and a
+//   fraction lands through the mid (marketable limits)
+// - sizes are Pareto (power law) between minQty and maxQty
+// - cancels hit one of the last cancelWindow ids (some already filled, as in real flow)
+// - Poisson arrival times
+struct FlowConfig {
+    Price mid = DEMO_MID;
+    double meanOffset = 6;      // mean distance from the mid in ticks, passive side
+    double crossRatio = 0.08;   // limits priced through the mid
+    double driftProb = 0.02;    // per event, the mid steps one tick up or down
+    double marketRatio = 0.03, cancelRatio = 0.25, iocRatio = 0.005;
+    int minQty = 1, maxQty = 5000; double sizeAlpha = 1.6;
+    int cancelWindow = 4096;
+    double rate = 1e6;          // events/s for OrderCmd::ts
+};
+
+// Generates the whole command stream into a flat array before anything is timed, so a
+// timed loop over it measures the engine alone (no RNG, no distributions, no clock per order).
+inline vector<OrderCmd> generateFlow(const FlowConfig &fc, size_t n, u64 seed, u64 firstId=1) {
+    vector<OrderCmd> out(n);
+    Xoshiro256 rng(seed); Price mid = fc.mid; u64 nextId = firstId; double ts = 0;
+    const double offScale = fc.meanOffset, sizeExp = -1.0 / fc.sizeAlpha, gapNs = 1e9 / fc.rate;
+    for (size_t i = 0; i < n; i++) {
+        OrderCmd &c = out[i];
+        ts += -log1p(-rng.uniform()) * gapNs; c.ts = (u64)ts;
+        if (rng.chance(fc.driftProb)) mid += (rng.next() & 1) ? 1 : -1;
+        double u = rng.uniform();
+        if (u < fc.cancelRatio && nextId > firstId) {
+            c.type = CmdType::CANCEL; c.clientId = nextId - 1 - rng.below(min<u64>(nextId - firstId, (u64)fc.cancelWindow)); continue;
+        }
+        c.clientId = nextId++; c.side = (rng.next() & 1) ? Side::BUY : Side::SELL;
+        c.qty = (int32_t)min<double>(fc.maxQty, floor(fc.minQty * pow(1.0 - rng.uniform(), sizeExp)));
+        if (u < fc.cancelRatio + fc.marketRatio) { c.type = CmdType::MARKET; continue; }
+        Price off = 1 + (Price)(-log1p(-rng.uniform()) * offScale), dir = c.side==Side::BUY ? -1 : 1;
+        if (rng.chance(fc.crossRatio)) dir = -dir;
+        c.type = CmdType::NEW; c.price = (int32_t)max<Price>(MIN_PRICE_TICKS, mid + dir * off);
+        c.tif = rng.chance(fc.iocRatio) ? TimeInForce::IOC : TimeInForce::GFD;
+    }
+    return out;
+}
+
+// Multi-symbol flow for ShardedEngine: WorkloadGen per order, symbol drawn
+// uniformly, and a cancel of a recent order of the same symbol every cancelEvery.
+// skew > 0: symbol k is picked with weight 1 / (k+1)^skew (Zipf) instead of uniformly
+struct MultiSymbolGen {
+    WorkloadGen gen; uniform_int_distribution<uint32_t> symDist; discrete_distribution<uint32_t> zipf; bool skewed; int cancelEvery; u64 n = 0;
+    vector<u64> seq; // mirrors ShardedEngine's per-symbol id sequence
+    MultiSymbolGen(uint64_t seed, uint32_t nSymbols, int cancelEvery=20, double skew=0)
+        :gen(seed, DEMO_LO, DEMO_HI), symDist(0, nSymbols-1), skewed(skew > 0), cancelEvery(cancelEvery), seq(nSymbols, 1) {
+        if (skewed) { vector<double> w(nSymbols); for (uint32_t k=0;k<nSymbols;k++) w[k] = pow(k + 1.0, -skew); zipf = discrete_distribution<uint32_t>(w.begin(), w.end()); }
+    }
+    OrderCmd next() {
+        OrderCmd c; c.symbol = skewed ? zipf(gen.rng) : symDist(gen.rng);
+        if (cancelEvery > 0 && (++n % cancelEvery)==0 && seq[c.symbol] > 1) {
+            c.type = CmdType::CANCEL; c.clientId = ShardedEngine::globalId(c.symbol, seq[c.symbol] - 1 - gen.rng() % min<u64>(seq[c.symbol]-1, 64)); return c;
+        }
+        auto [otype, side, px, qty] = gen.next();
+        c.side = side; c.qty = (int32_t)qty; c.clientId = ShardedEngine::globalId(c.symbol, seq[c.symbol]++);
+        if (otype==OrderType::MARKET) c.type = CmdType::MARKET; else { c.type = CmdType::NEW; c.price = (int32_t)px; }
+        return c;
+    }
+};
+
+// ------------------------------- EVENT FILES -----------------------------
+// Binary order-event capture: a 32-byte header followed by raw OrderCmd records
+// (native endianness). NEW / CANCEL / REPLACE / MARKET, ts = original event time in ns.
+struct EventFileHeader {
+    char magic[8] = {'H','F','T','E','V','T','1','\0'};
+    uint32_t version = 1;
+    uint32_t recordSize = sizeof(OrderCmd);
+    u64 count = 0;
+    u64 reserved = 0;
+};
+static_assert(sizeof(EventFileHeader) == 32, "event file header layout");
+
+// Buffered writer; patches the record count into the header on close.
+struct EventWriter {
+    FILE *f = nullptr; EventFileHeader hdr;
+    EventWriter(const string &path) {
+        f = fopen(path.c_str(), "wb");
+        if (!f) throw runtime_error("cannot create event file " + path);
+        fwrite(&hdr, sizeof(hdr), 1, f);
+    }
+    ~EventWriter() { close(); }
+    void write(const OrderCmd &c) { fwrite(&c, sizeof(c), 1, f); ++hdr.count; }
+    void close() { if (!f) return; fseek(f, 0, SEEK_SET); fwrite(&hdr, sizeof(hdr), 1, f); fclose(f); f = nullptr; }
+};
+
+#ifdef __unix__
+// Read-only mapping of an event file; records are used in place (zero-copy).
+struct MappedEventFile {
+    const char *base = nullptr; size_t bytes = 0;
+    const OrderCmd *events = nullptr; size_t count = 0;
+    MappedEventFile(const string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("cannot open event file " + path);
+        bytes = (size_t)lseek(fd, 0, SEEK_END);
+        void *p = bytes >= sizeof(EventFileHeader) ? mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED) throw runtime_error("cannot map event file " + path);
+        base = (const char*)p;
+        const EventFileHeader &h = *(const EventFileHeader*)base;
+        if (memcmp(h.magic, EventFileHeader().magic, 8) != 0 || h.recordSize != sizeof(OrderCmd) || sizeof(h) + h.count * sizeof(OrderCmd) > bytes)
+            { munmap((void*)base, bytes); throw runtime_error("bad event file " + path); }
+        madvise((void*)base, bytes, MADV_SEQUENTIAL);
+        events = (const OrderCmd*)(base + sizeof(h)); count = h.count;
+    }
+    ~MappedEventFile() { if (base) munmap((void*)base, bytes); }
+};
+
+// Feed a mapped capture into an engine. paced: hold each event until its original
+// offset from the first event has elapsed (TSC clock); otherwise full speed.
+// Returns wall seconds spent in the loop.
+// Full speed feeds the mapped records straight to Engine::submitBatch in bursts of `batch`.
+template<class EngineT> double replay(EngineT &engine, const MappedEventFile &f, bool paced=false, size_t batch=64) {
+    const TscClock &clk = TscClock::get();
+    u64 t0 = clk.now(), ts0 = f.count ? f.events[0].ts : 0;
+    if (!paced) {
+        for (size_t i=0;i<f.count;i+=batch) engine.submitBatch(f.events + i, min(batch, f.count - i));
+        return (double)(clk.now() - t0) * 1e-9;
+    }
+    for (size_t i=0;i<f.count;i++) {
+        const OrderCmd &c = f.events[i];
+        u64 due = t0 + (c.ts - ts0); while (clk.now() < due) cpuRelax();
+        engine.apply(c);
+    }
+    return (double)(clk.now() - t0) * 1e-9;
+}
+#endif
+
+// The demo's preload + workload as a command stream (same seeds, same ids), with
+// Poisson arrival times at `rate` events/s, so captures replay to the demo's trades.
+template<class F> void generateDemoFlow(F &&emit, int total=500000, double rate=1e6) {
+    mt19937_64 arrivals(7); exponential_distribution<double> gap(rate / 1e9); double ts = 0;
+    u64 nextId = 1;
+    auto out = [&](OrderCmd c) { ts += gap(arrivals); c.ts = (u64)ts; emit(c); };
+    mt19937_64 prng(42);
+    uniform_int_distribution<int> offs(0,2000);
+    for (int i=0;i<100000;i++){
+        Price p = DEMO_MID + ((i&1)?offs(prng):-offs(prng));
+        OrderCmd c; c.type = CmdType::NEW; c.clientId = nextId++; c.side = (i&1)?Side::BUY:Side::SELL; c.price = (int32_t)p; c.qty = (i&7)+1; out(c);
+    }
+    WorkloadGen gen(123, DEMO_LO, DEMO_HI);
+    for (int i=0;i<total;i++){
+        auto [otype, side, px, qty] = gen.next();
+        OrderCmd c; c.clientId = nextId++; c.side = side; c.qty = (int32_t)qty;
+        if (otype==OrderType::MARKET) c.type = CmdType::MARKET;
+        else { c.type = CmdType::NEW; c.price = (int32_t)px; c.tif = (i%200==0)?TimeInForce::IOC:TimeInForce::GFD; }
+        out(c);
+        if ((i%10000)==0 && i>0) { OrderCmd x; x.type = CmdType::CANCEL; x.clientId = (u64)(gen.rng() % nextId) + 1; out(x); }
+    }
+}
+
+#ifdef __unix__
+// ---------------------------- PARALLEL REPLAY ----------------------------
+// Work-stealing pool for coarse tasks: one deque per worker. The owner pushes and pops
+// at the back (LIFO: a task it just spawned finds its data still in cache); an idle
+// worker steals from the front of the others'. A task may push follow-up tasks, and the
+// pool is done once no task is queued or running. A task is thousands of events here,
+// so a spinlock per deque costs nothing next to it.
+template<class Task> struct WorkStealingPool {
+    struct alignas(CACHE_LINE) Queue { atomic_flag busy = ATOMIC_FLAG_INIT; deque<Task> q; u64 steals = 0; };
+    vector<Queue> queues;
+    atomic<size_t> pending{0}; // queued + running
+    WorkStealingPool(int workers):queues((size_t)max(1, workers)) {}
+    int workers() const { return (int)queues.size(); }
+    void push(int w, const Task &t) { pending.fetch_add(1, memory_order_relaxed); Queue &q = queues[w]; lock(q); q.q.push_back(t); unlock(q); }
+    // f(worker, task) on one thread per queue (pinned to cores[w] when given) until the pool drains
+    template<class F> void run(F &&f, const vector<int> &cores={}) {
+        vector<thread> th;
+        for (int w=0;w<workers();w++) th.emplace_back([&, w] {
+            pinThread(w < (int)cores.size() ? cores[w] : -1);
+            Waiter idle(WaitMode::BACKOFF); Task t;
+            while (pending.load(memory_order_acquire)) {
+                if (!take(w, t)) { idle.idle(); continue; }
+                idle.reset(); f(w, t); pending.fetch_sub(1, memory_order_acq_rel);
+            }
+        });
+        for (auto &t : th) t.join();
+    }
+    u64 steals() const { u64 n = 0; for (auto &q : queues) n += q.steals; return n; }
+private:
+    static void lock(Queue &q) { while (q.busy.test_and_set(memory_order_acquire)) cpuRelax(); }
+    static void unlock(Queue &q) { q.busy.clear(memory_order_release); }
+    bool take(int w, Task &t) {
+        Queue &own = queues[w];
+        lock(own); bool got = !own.q.empty(); if (got) { t = own.q.back(); own.q.pop_back(); } unlock(own);
+        if (got) return true;
+        for (int k=1;k<workers();k++) {
+            Queue &v = queues[(w + k) % workers()];
+            lock(v); got = !v.q.empty(); if (got) { t = v.q.front(); v.q.pop_front(); } unlock(v);
+            if (got) { ++own.steals; return true; }
+        }
+        return false;
+    }
+};
+
+// Tallies what the reports of one symbol's engine traded, from the reports themselves.
+struct TradeTallySink : NullReportSink {
+    u64 trades = 0; i64 volume = 0, notional = 0;
+    void commit(size_t n) override {
+        count += n;
+        for (size_t i=0;i<n;i++) if (scratch[i].isTrade()) { ++trades; volume += scratch[i].qty; notional += scratch[i].qty * (i64)scratch[i].price; }
+    }
+};
+
+// Replays a multi-symbol capture on `threads` workers. The file is partitioned by symbol
+// into one contiguous command array per symbol (ids reduced to their per-symbol part,
+// as ShardedEngine does). Each symbol gets its own Engine, built by the worker that
+// runs its first chunk. A chunk is `chunk` consecutive events of one symbol, fed
+// through submitBatch. When it finishes, the next chunk of that symbol is queued on
+// the same worker. The first chunks are dealt largest symbol first, so the pool
+// starts with the long streams and steals balance the rest. Symbols are independent
+// and each runs in capture order, so per-symbol results do not depend on `threads`.
+struct SymbolReplay {
+    unique_ptr<Engine> engine; TradeTallySink tally;
+    size_t begin = 0, end = 0; // its slice of the partitioned array
+    u64 busyNs = 0;
+};
+struct ParallelReplayResult {
+    int threads = 0; u64 events = 0, trades = 0, reports = 0, steals = 0; i64 volume = 0, notional = 0;
+    double partitionMs = 0, wallMs = 0;
+    vector<u64> eventsBySymbol, tradesBySymbol, busyNsBySymbol;
+    HFT_LAT_ONLY(LatencyStats stats;) // every symbol's engine stats, merged
+};
+inline ParallelReplayResult replayParallel(const MappedEventFile &f, int threads, const EngineConfig &cfg=EngineConfig(), const vector<int> &cores={}, size_t chunk=1<<15, size_t batch=64) {
+    auto ms = [](chrono::steady_clock::time_point a) { return chrono::duration<double, milli>(chrono::steady_clock::now() - a).count(); };
+    ParallelReplayResult r; r.threads = max(1, threads); r.events = f.count;
+    auto p0 = chrono::steady_clock::now();
+    uint32_t nSym = 0; for (size_t i=0;i<f.count;i++) nSym = max(nSym, f.events[i].symbol + 1);
+    vector<SymbolReplay> sym(nSym);
+    for (size_t i=0;i<f.count;i++) sym[f.events[i].symbol].end++;
+    size_t at = 0; for (auto &sr : sym) { sr.begin = at; at += sr.end; sr.end = sr.begin; }
+    vector<OrderCmd> part(f.count);
+    for (size_t i=0;i<f.count;i++) { OrderCmd &c = part[sym[f.events[i].symbol].end++] = f.events[i]; c.clientId &= ShardedEngine::LOCAL_MASK; }
+    r.partitionMs = ms(p0);
+
+    struct Chunk { uint32_t symbol; size_t begin, end; };
+    WorkStealingPool<Chunk> pool(r.threads);
+    vector<uint32_t> order(nSym); iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return sym[a].end - sym[a].begin > sym[b].end - sym[b].begin; });
+    int next = 0;
+    for (uint32_t s : order) if (sym[s].end > sym[s].begin) { pool.push(next, Chunk{s, sym[s].begin, min(sym[s].end, sym[s].begin + chunk)}); next = (next + 1) % r.threads; }
+    auto w0 = chrono::steady_clock::now();
+    pool.run([&](int w, const Chunk &c) {
+        SymbolReplay &sr = sym[c.symbol];
+        if (!sr.engine) { EngineConfig ec = cfg; ec.symbol = c.symbol; sr.engine.reset(new Engine(ec)); sr.engine->setSink(&sr.tally); }
+        u64 t0 = readTsc();
+        for (size_t i=c.begin;i<c.end;i+=batch) sr.engine->submitBatch(part.data() + i, min(batch, c.end - i));
+        sr.busyNs += TscClock::get().toNs(readTsc() - t0);
+        if (c.end < sr.end) pool.push(w, Chunk{c.symbol, c.end, min(sr.end, c.end + chunk)});
+    }, cores);
+    r.wallMs = ms(w0); r.steals = pool.steals();
+    for (auto &sr : sym) {
+        r.eventsBySymbol.push_back(sr.end - sr.begin); r.tradesBySymbol.push_back(sr.engine ? sr.engine->tradeCount : 0); r.busyNsBySymbol.push_back(sr.busyNs);
+        if (!sr.engine) continue;
+        r.trades += sr.engine->tradeCount; r.reports += sr.tally.count; r.volume += sr.tally.volume; r.notional += sr.tally.notional;
+        HFT_LAT_ONLY(r.stats.merge(sr.engine->stats);)
+    }
+    return r;
+}
+#endif
+
+// ------------------------------- SNAPSHOTS -------------------------------
+// Binary image of one Engine for warm restarts. It holds the pool records up to the
+// high-water mark (hot and cold arrays verbatim, free chain included) and every
+// non-empty level header with its side and tick. It also holds the clientId ->
+// engineId entries of resting orders, the reserve records of resting icebergs, the
+// book position, the risk counters and the engine counters. Restore copies the arrays out of a read-only mapping and re-links
+// nothing: the level headers already point at the right pool slots. Attach market
+// data after a restore and resync subscribers from a snapshot. Native endianness;
+// sections are 64-byte aligned.
+struct SnapshotHeader {
+    char magic[8] = {'H','F','T','S','N','P','1','\0'};
+    uint32_t version = 6;
+    uint16_t hotSize = sizeof(HotOrder), coldSize = sizeof(ColdOrder);
+    uint32_t symbol = 0; int32_t window = 0, base = 0, target = 0, bestBid = -1, bestAsk = -1;
+    u64 records = 0, levels = 0, ids = 0, reserves = 0; // pool high-water mark, non-empty levels, index entries, icebergs
+    uint32_t freeHead = NIL, flags = 0; // flags bit 0: auction call open
+    uint32_t clockMode = 0, reserved = 0; // ClockMode the stamps and logicalClock come from
+    u64 nextClientId = 0, tradeCount = 0, logicalClock = 0, reportSeq = 0;
+    u64 journalSeq = 0; // first journaled command the snapshot does not reflect
+    u64 journalId = 0;  // the journal journalSeq counts in; 0: taken without one
+    u64 hotOff = 0, coldOff = 0, levelOff = 0, idOff = 0, resOff = 0, riskOff = 0, bytes = 0;
+};
+static_assert(sizeof(SnapshotHeader) == 192, "snapshot header layout");
+struct SnapLevel { int32_t tick; Side side; uint8_t pad[3]; RingLevel level; };
+static_assert(sizeof(SnapLevel) == 40, "snapshot level record layout");
+struct SnapId { u64 clientId, engineId; };
+struct SnapReserve { u64 engineId; ReserveOrder r; };
+
+// Returns the file size. The engine should be between events (no staged trades).
+template<class EngineT> size_t saveSnapshot(EngineT &e, const string &path) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) throw runtime_error("cannot create snapshot " + path);
+    SnapshotHeader h; const OrderBook &b = e.book;
+    h.symbol = e.symbol; h.window = b.window; h.base = b.base; h.target = b.target; h.bestBid = b.bestBid; h.bestAsk = b.bestAsk;
+    h.records = e.pool.bump; h.freeHead = e.pool.freeHead;
+    h.nextClientId = e.nextClientId; h.tradeCount = e.tradeCount; h.logicalClock = e.clock.logical; h.reportSeq = e.reportSeq; h.flags = e.auction ? 1u : 0u;
+    h.clockMode = (uint32_t)e.clock.mode;
+    if (e.journal) { h.journalSeq = e.journal->seq; h.journalId = e.journal->id; }
+    u64 pos = sizeof(h);
+    auto align = [&] { static const char zero[64] = {}; size_t pad = (size_t)(-pos & 63); fwrite(zero, 1, pad, f); pos += pad; return pos; };
+    auto put = [&](const void *p, size_t n) { fwrite(p, 1, n, f); pos += n; };
+    fwrite(&h, sizeof(h), 1, f);
+    h.hotOff = align(); put(e.pool.hotRecs, h.records * sizeof(HotOrder));
+    h.coldOff = align(); put(e.pool.coldRecs, h.records * sizeof(ColdOrder));
+    h.levelOff = align();
+    for (Side s : {Side::BUY, Side::SELL})
+        h.levels += b.forTop(s, INT_MAX, [&](int t, const RingLevel &l) { SnapLevel r{t, s, {}, l}; put(&r, sizeof(r)); });
+    h.idOff = align();
+    for (u64 i = 0; i < h.records; i++) { // only entries that still name a resting order
+        const ColdOrder &c = e.pool.coldRecs[i];
+        if (c.active && e.clientToEngine.find(c.clientId) == i) { SnapId r{c.clientId, i}; put(&r, sizeof(r)); ++h.ids; }
+    }
+    h.resOff = align();
+    for (u64 i = 0; i < h.records; i++)
+        if (e.pool.coldRecs[i].active && e.pool.coldRecs[i].kind == OrderKind::ICEBERG) { SnapReserve r{i, e.pool.res(i)}; put(&r, sizeof(r)); ++h.reserves; }
+    h.riskOff = align(); put(e.risk.acct, sizeof(e.risk.acct));
+    h.bytes = pos;
+    fseek(f, 0, SEEK_SET); fwrite(&h, sizeof(h), 1, f);
+    if (fclose(f) != 0) throw runtime_error("cannot write snapshot " + path);
+    return (size_t)pos;
+}
+
+#ifdef __unix__
+// Where a snapshot sits in the journal it was taken against (id 0: none)
+struct JournalPosition { u64 journalId = 0, seq = 0; };
+
+// Bulk-load a snapshot into a freshly constructed engine with the same price window and
+// clock mode (set the mode before restoring).
+// No order goes through the matcher. Returns the journal position to replay from.
+template<class EngineT> JournalPosition loadSnapshot(EngineT &e, const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("cannot open snapshot " + path);
+    size_t bytes = (size_t)lseek(fd, 0, SEEK_END);
+    void *m = bytes >= sizeof(SnapshotHeader) ? mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (m == MAP_FAILED) throw runtime_error("cannot map snapshot " + path);
+    const char *base = (const char*)m; const SnapshotHeader &h = *(const SnapshotHeader*)base;
+    auto fail = [&](const char *why) { munmap(m, bytes); throw runtime_error(string(why) + ": " + path); };
+    if (memcmp(h.magic, SnapshotHeader().magic, 8) != 0 || h.version != SnapshotHeader().version || h.hotSize != sizeof(HotOrder) || h.coldSize != sizeof(ColdOrder) || h.bytes > bytes)
+        fail("bad snapshot");
+    if (h.window != e.book.window) fail("snapshot price window differs from the engine's");
+    if (h.clockMode != (uint32_t)e.clock.mode) fail("snapshot clock mode differs from the engine's");
+    // Everything below is checked before the engine is touched: each section lies inside
+    // the file, aligned, in order and without overlap, and every index it holds stays
+    // inside the pool, so a truncated or corrupt file cannot send the restore out of bounds.
+    u64 at = sizeof(SnapshotHeader);
+    auto section = [&](u64 off, u64 n, u64 size) { // [off, off + n * size) follows `at`
+        if (off < at || off % 64 || off > h.bytes || n > (h.bytes - off) / size) fail("bad snapshot section");
+        at = off + n * size;
+    };
+    section(h.hotOff, h.records, sizeof(HotOrder)); section(h.coldOff, h.records, sizeof(ColdOrder)); section(h.levelOff, h.levels, sizeof(SnapLevel));
+    section(h.idOff, h.ids, sizeof(SnapId)); section(h.resOff, h.reserves, sizeof(SnapReserve)); section(h.riskOff, 1, sizeof(e.risk.acct));
+    const HotOrder *hot = (const HotOrder*)(base + h.hotOff); const ColdOrder *cold = (const ColdOrder*)(base + h.coldOff);
+    const u64 R = h.records;
+    auto link = [&](uint32_t i) { return i == NIL || i < R; };
+    auto tick = [&](i64 t) { return t >= 0 && t <= priceToIdx(MAX_PRICE_TICKS); };
+    auto origin = [&](i64 b) { return b >= -(i64)h.window && b <= priceToIdx(MAX_PRICE_TICKS); }; // where a window may start
+    if (R > NIL || !link(h.freeHead) || (h.bestBid != -1 && !tick(h.bestBid)) || (h.bestAsk != -1 && !tick(h.bestAsk))
+        || !origin(h.base) || !origin(h.target)) fail("bad snapshot book position");
+    u64 active = 0;
+    for (u64 i = 0; i < R; i++) {
+        uint8_t act; memcpy(&act, &cold[i].active, 1); active += act;
+        if (!link(hot[i].prev) || !link(hot[i].next) || act > 1
+            || (act && ((uint8_t)cold[i].side > 1 || (uint8_t)cold[i].kind > 2 || !tick(cold[i].priceIdx)))) fail("bad snapshot order record");
+    }
+    // levels as saveSnapshot writes them: bids best first, then asks best first (so no tick
+    // twice, and each side's first level is its best); each queue holds `count` linked
+    // records from head to tail, all resting there, and together they are every active record
+    const SnapLevel *lv = (const SnapLevel*)(base + h.levelOff); u64 walked = 0; int firstBid = -1, firstAsk = -1;
+    for (u64 i = 0; i < h.levels; i++) {
+        const SnapLevel &l = lv[i]; const RingLevel &q = l.level;
+        if ((uint8_t)l.side > 1 || !tick(l.tick) || q.head == NIL || q.head >= R || q.tail >= R || q.hiddenCount > q.count) fail("bad snapshot level");
+        if (i && (l.side < lv[i-1].side || (l.side == lv[i-1].side && (l.side == Side::BUY ? l.tick >= lv[i-1].tick : l.tick <= lv[i-1].tick)))) fail("bad snapshot level order");
+        int &first = l.side == Side::BUY ? firstBid : firstAsk; if (first == -1) first = l.tick;
+        uint32_t prev = NIL, cur = q.head;
+        for (uint32_t k = 0; k < q.count; k++) {
+            if (cur >= R || ++walked > R || hot[cur].prev != prev || !cold[cur].active || cold[cur].side != l.side || cold[cur].priceIdx != l.tick) fail("bad snapshot level queue");
+            prev = cur; cur = hot[cur].next;
+        }
+        if (prev != q.tail || cur != NIL) fail("bad snapshot level queue");
+    }
+    if (walked != active || h.bestBid != firstBid || h.bestAsk != firstAsk) fail("bad snapshot book");
+    u64 freeLen = 0; // the free chain only hands out records nothing rests in
+    for (uint32_t i = h.freeHead; i != NIL; i = hot[i].next) if (++freeLen > R - active || cold[i].active) fail("bad snapshot free chain");
+    const SnapId *ids = (const SnapId*)(base + h.idOff);
+    for (u64 i = 0; i < h.ids; i++) if (ids[i].engineId >= R || !cold[ids[i].engineId].active) fail("bad snapshot id entry");
+    const SnapReserve *rs = (const SnapReserve*)(base + h.resOff);
+    for (u64 i = 0; i < h.reserves; i++) if (rs[i].engineId >= R || cold[rs[i].engineId].kind != OrderKind::ICEBERG) fail("bad snapshot reserve entry");
+    try { e.pool.restore(hot, cold, h.records, h.freeHead); }
+    catch (const exception &ex) { fail(ex.what()); }
+    e.book.restore(h.base, h.target, h.bestBid, h.bestAsk);
+    for (u64 i = 0; i < h.levels; i++) e.book.restoreLevel(lv[i].side, lv[i].tick, lv[i].level);
+    for (u64 i = 0; i < h.ids; i++) e.clientToEngine.insert(ids[i].clientId, ids[i].engineId);
+    for (u64 i = 0; i < h.reserves; i++) e.pool.setReserve(rs[i].engineId, rs[i].r.reserve, rs[i].r.peak);
+    memcpy((void*)e.risk.acct, base + h.riskOff, sizeof(e.risk.acct));
+    e.nextClientId = h.nextClientId; e.tradeCount = h.tradeCount; e.clock.logical = h.logicalClock; e.reportSeq = h.reportSeq; e.auction = h.flags & 1u;
+    JournalPosition pos{h.journalId, h.journalSeq};
+    munmap(m, bytes);
+    return pos;
+}
+
+// Crash recovery: optional snapshot, then the journal records it does not cover, through
+// the normal matching path (the engine must have no journal attached). The snapshot must
+// have been taken against this journal; otherwise this throws before replaying anything.
+// nextClientId is moved past every replayed new order's id. Returns the sequence number
+// a new journal should start at.
+template<class EngineT> u64 recoverEngine(EngineT &e, const string &journalPath, const string &snapshotPath="") {
+    JournalPosition from;
+    if (!snapshotPath.empty()) {
+        from = loadSnapshot(e, snapshotPath);
+        if (!from.journalId) throw runtime_error("snapshot " + snapshotPath + " was taken without a journal");
+        if (journalIdOf(journalPath) != from.journalId) throw runtime_error("snapshot " + snapshotPath + " was not taken against journal " + journalPath);
+    }
+    u64 next = readJournal(journalPath, [&](u64 seq, const OrderCmd &c) {
+        if (seq < from.seq) return;
+        if (c.type == CmdType::NEW || c.type == CmdType::MARKET || c.type == CmdType::RESERVE) e.nextClientId = max(e.nextClientId, c.clientId + 1);
+        e.apply(c);
+    });
+    return max(next, from.seq);
+}
+#endif
+
+// ------------------------------- PERF COUNTERS ---------------------------
+// Hardware cache counters for the calling thread via perf_event_open (user space
+// only). Unavailable without a PMU (most VMs) or with perf_event_paranoid > 2.
+struct PerfCounters {
+    static constexpr int N = 3;
+    const char *names[N] = {"cache-references", "cache-misses", "L1d-read-misses"};
+    int fds[N] = {-1, -1, -1};
+    PerfCounters() {
+#ifdef __linux__
+        u64 cfg[N] = { PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+        uint32_t type[N] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+        for (int i=0;i<N;i++) {
+            perf_event_attr a; memset(&a, 0, sizeof(a)); a.size = sizeof(a); a.type = type[i]; a.config = cfg[i];
+            a.disabled = 1; a.exclude_kernel = 1; a.exclude_hv = 1;
+            fds[i] = (int)syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+        }
+#endif
+    }
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int fd : fds) if (fd >= 0) ::close(fd);
+#endif
+    }
+    bool available() const { return fds[0] >= 0; }
+    void start() {
+#ifdef __linux__
+        for (int fd : fds) if (fd >= 0) { ioctl(fd, PERF_EVENT_IOC_RESET, 0); ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); }
+#endif
+    }
+    void stop() {
+#ifdef __linux__
+        for (int fd : fds) if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+    }
+    bool value(int i, u64 &v) const {
+#ifdef __linux__
+        return fds[i] >= 0 && ::read(fds[i], &v, sizeof(v)) == sizeof(v);
+#else
+        (void)i; (void)v; return false;
+#endif
+    }
+    void report(ostream &os, u64 perOps) const {
+        for (int i=0;i<N;i++) {
+            u64 v = 0;
+            if (!value(i, v)) { os<<names[i]<<": n/a\n"; continue; }
+            os<<names[i]<<": "<<v<<" ("<<(double)v/perOps<<"/order)\n";
+        }
+    }
+};
+
+#ifndef HFT_SIM_NO_MAIN // hft-bench.cpp includes this file for the engine only
+// ------------------------------- CANCEL BENCH ----------------------------
+// Cancel latency vs. level depth: hold one ask level at `depth` orders, cancel a random
+// resting order and re-add a fresh one at the tail so the depth stays constant.
+static void benchCancel(Engine &engine) {
+    const int idx = 10000; const int ROUNDS = 200000;
+    mt19937_64 rng(7);
+    cout<<"depth,ns_per_cancel (incl. timer overhead)\n";
+    for (int depth : {1, 16, 64, 256, 1024, 4096, 16384}) {
+        vector<u64> ids;
+        for (int i=0;i<depth;i++){ ids.push_back(engine.nextClientId++); engine.placeLimit(ids.back(), Side::SELL, idx, 1); }
+        double ns = 0;
+        for (int r=0;r<ROUNDS;r++){
+            size_t k = rng() % depth;
+            auto a = chrono::steady_clock::now(); engine.cancel(ids[k]); auto b = chrono::steady_clock::now();
+            ns += chrono::duration<double, nano>(b-a).count();
+            ids[k] = engine.nextClientId++; engine.placeLimit(ids[k], Side::SELL, idx, 1);
+        }
+        cout<<depth<<","<<ns/ROUNDS<<"\n";
+        for (u64 cid : ids) engine.cancel(cid);
+    }
+}
+
+// ------------------------------- ID INDEX BENCH --------------------------
+// Engine-shaped access pattern against each index: insert dense ids, look up and
+// erase a random live one, insert the next id (steady ~live entries).
+template<class Map> static double idIndexRound(Map &m, u64 live, u64 ops) {
+    mt19937_64 rng(11); u64 next = 1, sink = 0;
+    for (; next <= live; ++next) m.insert(next, next);
+    auto a = chrono::steady_clock::now();
+    for (u64 i=0;i<ops;i++){
+        u64 k = next - 1 - rng() % live; // live window is [next-live, next)
+        sink += m.find(k); m.erase(k); m.insert(k, k); // keep the window full
+        m.insert(next, next); m.erase(next - live); ++next;
+    }
+    auto b = chrono::steady_clock::now();
+    if (sink == 42) cout<<"";
+    return chrono::duration<double, nano>(b-a).count() / ops;
+}
+struct StdIdIndex { // baseline: what Engine used before
+    unordered_map<u64,u64> m; StdIdIndex(size_t cap) { m.reserve(cap); }
+    inline u64 find(u64 k) const { auto it = m.find(k); return it==m.end() ? FlatIdIndex::NONE : it->second; }
+    inline void insert(u64 k, u64 v) { m[k] = v; }
+    inline void erase(u64 k) { m.erase(k); }
+};
+static void benchIdIndex() {
+    const u64 OPS = 2'000'000;
+    cout<<"live,unordered_map_ns,flat_ns,direct_ns (per find+2 erase+2 insert round)\n";
+    for (u64 live : {1000ull, 100000ull, 1000000ull}) {
+        StdIdIndex s(1<<20); FlatIdIndex f(live*2); DirectIdIndex d(ID_INDEX_CAPACITY);
+        double ts = idIndexRound(s, live, OPS), tf = idIndexRound(f, live, OPS), td = idIndexRound(d, live, OPS);
+        cout<<live<<","<<ts<<","<<tf<<","<<td<<"\n";
+    }
+}
+
+// ------------------------------- SHARD BENCH -----------------------------
+// Throughput of ShardedEngine for 1..16 shards on the same pre-generated flow;
+// shard i is pinned to core i % ncores. The generator thread also drains trades.
+static void benchShards() {
+    const uint32_t SYMBOLS = 64; const size_t TOTAL = 2'000'000;
+    MultiSymbolGen gen(99, SYMBOLS);
+    vector<OrderCmd> flow(TOTAL); for (auto &c : flow) c = gen.next();
+    EngineConfig cfg; cfg.poolCapacity = 1<<17; cfg.idCapacity = 1<<17; cfg.priceWindow = 1<<10; // flow spans ~200 ticks
+    int ncores = (int)max(1u, thread::hardware_concurrency());
+    cout<<"shards,orders_per_s,trades (symbols="<<SYMBOLS<<", cores="<<ncores<<")\n";
+    for (int n : {1, 2, 4, 8, 16}) {
+        vector<int> cores; for (int i=0;i<n;i++) cores.push_back(i % ncores);
+        ShardedEngine se(n, SYMBOLS, cfg, cores, ncores >= n+1 ? WaitMode::SPIN : WaitMode::BACKOFF);
+        size_t trades = 0; auto count = [&](const ExecReport &r){ trades += r.isTrade(); }; se.drainWhileWaiting(count);
+        auto t0 = chrono::steady_clock::now();
+        for (const OrderCmd &c : flow) {
+            switch (c.type) {
+            case CmdType::NEW: se.placeLimit(c.symbol, c.side, c.price, c.qty); break;
+            case CmdType::MARKET: se.placeMarket(c.symbol, c.side, c.qty); break;
+            case CmdType::CANCEL: se.cancel(c.clientId); break;
+            case CmdType::REPLACE: se.replace(c.clientId, c.price, c.qty); break;
+            case CmdType::AUCTION: case CmdType::UNCROSS: case CmdType::PEAK: case CmdType::RESERVE: break; // not in this flow
+            }
+            if ((se.submitted & 255)==0) se.pollReports(count);
+        }
+        while (se.processed() < TOTAL) { se.pollReports(count); this_thread::yield(); }
+        double secs = chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+        se.stop(); se.pollReports(count);
+        cout<<n<<","<<TOTAL/secs<<","<<trades<<"\n";
+    }
+}
 
-    // preload liquidity
+// ------------------------------- DEMO MAIN -------------------------------
+// returns wall ms
+static double preload(Engine &engine) {
     cout<<"Preloading book...\n";
+    auto t0 = chrono::steady_clock::now();
     mt19937_64 prng(42);
     uniform_int_distribution<int> offs(0,2000);
     for (int i=0;i<100000;i++){
-        double base = 50.0; double p = base + ((i&1)?(offs(prng)*0.01):(-offs(prng)*0.01));
-        int pidx = pm.priceToIdx(p);
+        Price p = DEMO_MID + ((i&1)?offs(prng):-offs(prng));
         Side s = (i&1)?Side::BUY:Side::SELL; i64 q=(i&7)+1;
-        engine.placeLimit(engine.nextClientId++, s, pidx, q, chrono::high_resolution_clock::now());
+        engine.placeLimit(engine.nextClientId++, s, p, q);
+    }
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+// Same flow as the demo loop, but generated on this thread (ingress) and matched on
+// a MatchingThread; reports are drained by this thread, or by a sink thread of their
+// own. The RuntimeConfig's start-up steps (mlock, pre-fault) run first, untimed.
+static void runPipeline(Engine &engine, RuntimeConfig rc) {
+    if (rc.lockMemory || rc.prefault) {
+        auto p0 = chrono::steady_clock::now(); bool locked = rc.lockMemory && lockProcessMemory();
+        if (rc.prefault) engine.prefault(rc.farLevels, rc.overflowIds);
+        cout<<"Start-up: "<<(rc.lockMemory ? (locked ? "memory locked, " : "mlockall refused, ") : "")
+            <<(rc.prefault ? to_string(engine.pool.committed()) + " pool records + " + to_string(rc.farLevels) + " far levels pre-faulted, " : "")
+            <<chrono::duration<double, milli>(chrono::steady_clock::now() - p0).count()<<" ms\n";
+    }
+    if (!rc.realtimeSafe()) { cout<<"SCHED_FIFO dropped: spinning realtime stages need distinct pinned cores\n"; rc.ingress.fifoPriority = rc.match.fifoPriority = rc.sink.fifoPriority = 0; }
+    cout<<"Preload done. Starting pipeline ("<<(rc.wait==WaitMode::SPIN?"spin":"backoff")<<", cores ingress "<<rc.ingress.core<<" match "<<rc.match.core
+        <<" sink "<<(rc.sinkThread ? to_string(rc.sink.core) : string("= ingress"))<<")...\n";
+    MatchingThread<> mt(engine, 1<<16, 1<<18, rc.wait, rc.match);
+    WorkloadGen gen(123, DEMO_LO, DEMO_HI);
+    const int TOTAL = 500000;
+    u64 nextId = engine.nextClientId, ntrades = 0, nreports = 0;
+    auto drain = [&](const ExecReport &r) { ++nreports; ntrades += r.isTrade(); };
+    auto send = [&](const OrderCmd &c) { if (rc.sinkThread) mt.submit(c); else mt.submit(c, drain); }; // no sink thread: drain while waiting
+    atomic<bool> done{false}; ThreadPolicyStatus sinkSt; thread sinkTh;
+    if (rc.sinkThread) sinkTh = thread([&]{
+        sinkSt = applyThreadPolicy(rc.sink); NoAllocScope guard(rc.sink.noAlloc); Waiter ws(rc.wait);
+        while (!done.load(memory_order_acquire)) { if (mt.pollReports(drain)) ws.reset(); else ws.idle(); }
+    });
+    mt.start();
+    ThreadPolicyStatus inSt = applyThreadPolicy(rc.ingress);
+    auto t0 = chrono::steady_clock::now();
+    {
+        NoAllocScope guard(rc.ingress.noAlloc);
+        for (int i=0;i<TOTAL;i++){
+            auto [otype, side, px, qty] = gen.next();
+            OrderCmd c; c.clientId = nextId++; c.side = side; c.qty = qty;
+            if (otype==OrderType::MARKET) c.type = CmdType::MARKET;
+            else { c.type = CmdType::NEW; c.price = (int32_t)px; c.tif = (i%200==0)?TimeInForce::IOC:TimeInForce::GFD; }
+            send(c);
+            if ((i%10000)==0 && i>0) { OrderCmd x; x.type = CmdType::CANCEL; x.clientId = (u64)(gen.rng() % nextId) + 1; send(x); }
+            if (!rc.sinkThread) mt.pollReports(drain);
+        }
+        Waiter wt(rc.wait);
+        while (mt.processed.load(memory_order_acquire) < (u64)(TOTAL + (TOTAL-1)/10000)) { if (!rc.sinkThread) mt.pollReports(drain); wt.idle(); }
+    }
+    auto t1 = chrono::steady_clock::now();
+    mt.stop(); done.store(true, memory_order_release); if (sinkTh.joinable()) sinkTh.join();
+    mt.pollReports(drain);
+    double secs = chrono::duration<double>(t1-t0).count();
+    cout<<"Done. Orders: "<<TOTAL<<" Time: "<<secs<<"s Throughput: "<< (TOTAL/secs) <<" orders/s\n";
+    cout<<"Trades: "<<engine.tradeCount<<" (drained from the ring during the run: "<<ntrades<<", in "<<nreports<<" reports)\n";
+    auto show = [](const char *name, const ThreadPolicy &p, ThreadPolicyStatus st) {
+        cout<<name<<(p.core < 0 ? " unpinned" : st.pinned ? " pinned" : " pin refused")<<(p.fifoPriority <= 0 ? "" : st.realtime ? " fifo" : " fifo refused");
+    };
+    cout<<"Threads: "; show("ingress", rc.ingress, inSt); show(", match", rc.match, mt.applied); if (rc.sinkThread) show(", sink", rc.sink, sinkSt); cout<<"\n";
+    if (rc.ingress.noAlloc || rc.match.noAlloc || rc.sink.noAlloc) {
+        if (AllocGuard::enabled) cout<<"Allocation guard: "<<AllocGuard::violations.load()<<" heap allocations on guarded threads after start-up\n";
+        else cout<<"Allocation guard not compiled in (build with -DHFT_ALLOC_GUARD)\n";
+    }
+}
+// Pre-generated realistic flow (generateFlow) timed through apply() and submitBatch();
+// generation happens before the clock starts.
+static void runFlow(size_t n) {
+    auto ms = [](chrono::steady_clock::time_point a) { return chrono::duration<double, milli>(chrono::steady_clock::now() - a).count(); };
+    auto g0 = chrono::steady_clock::now();
+    vector<OrderCmd> cmds = generateFlow(FlowConfig(), n, 99);
+    double genMs = ms(g0);
+    cout<<"Generated "<<n<<" commands in "<<genMs<<" ms ("<<genMs*1e6/(double)n<<" ns/cmd, untimed)\n";
+    for (size_t batch : {(size_t)1, (size_t)64}) {
+        Engine engine; auto t0 = chrono::steady_clock::now();
+        if (batch == 1) for (const OrderCmd &c : cmds) engine.apply(c);
+        else for (size_t i=0;i<n;i+=batch) engine.submitBatch(cmds.data() + i, min(batch, n - i));
+        double t = ms(t0);
+        cout<<(batch==1?"apply:            ":"submitBatch(64):  ")<<t<<" ms, "<<t*1e6/(double)n<<" ns/cmd, "<<(double)n/t/1e3<<" Mcmd/s, trades "<<engine.tradeCount
+            <<", pool high-water "<<engine.pool.bump<<"\n";
+    }
+}
+// An opening call: n limit orders (a third priced through the mid) collected without
+// matching, then uncrossed; the same orders matched continuously for comparison.
+static void runAuction(size_t n) {
+    auto ms = [](chrono::steady_clock::time_point a) { return chrono::duration<double, milli>(chrono::steady_clock::now() - a).count(); };
+    FlowConfig fc; fc.marketRatio = fc.cancelRatio = fc.iocRatio = 0; fc.crossRatio = 0.33; fc.meanOffset = 20;
+    vector<OrderCmd> cmds = generateFlow(fc, n, 7);
+    {
+        Engine engine; engine.beginAuction();
+        auto t0 = chrono::steady_clock::now(); for (const OrderCmd &c : cmds) engine.apply(c); double collect = ms(t0);
+        int bid = engine.book.bestBid, ask = engine.book.bestAsk;
+        auto t1 = chrono::steady_clock::now(); auto r = engine.uncross(); double cross = ms(t1);
+        cout<<"Auction call: "<<n<<" orders in "<<collect<<" ms ("<<collect*1e6/(double)n<<" ns/order), crossed "<<formatPrice(idxToPrice(ask))<<" .. "<<formatPrice(idxToPrice(bid))<<"\n";
+        cout<<"Uncross: "<<cross<<" ms, price "<<formatPrice(idxToPrice(r.priceIdx))<<", volume "<<r.volume<<", imbalance "<<r.imbalance<<", trades "<<r.trades
+            <<", after: bestBid "<<formatPrice(idxToPrice(engine.book.bestBid))<<" bestAsk "<<formatPrice(idxToPrice(engine.book.bestAsk))<<"\n";
+    }
+    Engine engine;
+    auto t0 = chrono::steady_clock::now(); for (const OrderCmd &c : cmds) engine.apply(c); double cont = ms(t0);
+    cout<<"Continuous:   "<<n<<" orders in "<<cont<<" ms ("<<cont*1e6/(double)n<<" ns/order), trades "<<engine.tradeCount<<"\n";
+}
+#ifdef __unix__
+// Parallel replay of a capture at 1, 2, 4, ... up to maxThreads workers; every run must
+// produce the same trades. Then the busiest symbols and the merged latency report.
+static void runReplayParallel(const string &path, int maxThreads) {
+    MappedEventFile f(path);
+    EngineConfig cfg; cfg.poolCapacity = 1<<17; cfg.idCapacity = 1<<17; cfg.priceWindow = 1<<12;
+    int ncores = (int)max(1u, thread::hardware_concurrency());
+    cout<<"threads,wall_ms,events_per_s,speedup,steals,trades (events="<<f.count<<", cores="<<ncores<<")\n";
+    vector<int> counts; for (int t=1;t<maxThreads;t*=2) counts.push_back(t); counts.push_back(maxThreads);
+    ParallelReplayResult last; double base = 0;
+    for (int t : counts) {
+        vector<int> cores; for (int i=0;i<t;i++) cores.push_back(i % ncores);
+        ParallelReplayResult r = replayParallel(f, t, cfg, t <= ncores ? cores : vector<int>{});
+        if (!base) base = r.wallMs;
+        cout<<t<<","<<r.wallMs<<","<<(double)r.events/r.wallMs*1e3<<","<<base/r.wallMs<<","<<r.steals<<","<<r.trades<<"\n";
+        if (last.threads && r.trades != last.trades) cout<<"MISMATCH: trades differ from the previous run\n";
+        last = move(r);
+    }
+    cout<<"Partition: "<<last.partitionMs<<" ms; "<<last.tradesBySymbol.size()<<" symbols, "<<last.trades<<" trades, volume "<<last.volume
+        <<", VWAP "<<(last.volume ? formatPrice(last.notional / last.volume) : string("-"))<<", "<<last.reports<<" reports\n";
+    vector<size_t> bySize(last.eventsBySymbol.size()); iota(bySize.begin(), bySize.end(), 0);
+    sort(bySize.begin(), bySize.end(), [&](size_t a, size_t b) { return last.eventsBySymbol[a] > last.eventsBySymbol[b]; });
+    for (size_t k=0;k<bySize.size() && k<5;k++) { size_t s = bySize[k];
+        cout<<"  symbol "<<s<<": "<<last.eventsBySymbol[s]<<" events, "<<last.tradesBySymbol[s]<<" trades, "<<last.busyNsBySymbol[s]/1e6<<" ms busy\n"; }
+    HFT_LAT_ONLY(last.stats.report(cout);)
+}
+#endif
+int main(int argc, char **argv){
+    ios::sync_with_stdio(false); cin.tie(nullptr);
+    string mode = argc>1 ? argv[1] : "";
+    if (mode=="--bench-cancel") { Engine engine; benchCancel(engine); return 0; }
+    if (mode=="--bench-idindex") { benchIdIndex(); return 0; }
+    if (mode=="--bench-shards") { benchShards(); return 0; }
+    if (mode=="--flow") { runFlow(argc>2 ? (size_t)atol(argv[2]) : 2'000'000); return 0; }
+    if (mode=="--auction") { runAuction(argc>2 ? (size_t)atol(argv[2]) : 100'000); return 0; }
+    if (mode=="--record" && argc>2) {
+        EventWriter w(argv[2]); uint32_t symbols = argc>3 ? (uint32_t)max(1, atoi(argv[3])) : 1;
+        if (symbols == 1) generateDemoFlow([&](const OrderCmd &c){ w.write(c); });
+        else { MultiSymbolGen gen(99, symbols, 20, 1.0); for (int i=0;i<4'000'000;i++) w.write(gen.next()); } // Zipf-skewed symbols
+        cout<<"Recorded "<<w.hdr.count<<" events to "<<argv[2]<<"\n"; return 0;
+    }
+#ifdef __unix__
+    if (mode=="--replay" && argc>2) {
+        MappedEventFile f(argv[2]); bool paced = argc>3 && string(argv[3])=="paced";
+        Engine engine; engine.clock.setMode(ClockMode::EVENT);
+        double secs = replay(engine, f, paced);
+        cout<<"Replayed "<<f.count<<" events ("<<(paced?"paced":"full speed")<<") Time: "<<secs<<"s Throughput: "<<f.count/secs<<" events/s\n";
+        cout<<"Trades: "<<engine.tradeCount<<"\n";
+        HFT_LAT_ONLY(engine.stats.report(cout);)
+        return 0;
+    }
+    if (mode=="--replay-parallel" && argc>2) { runReplayParallel(argv[2], argc>3 ? max(1, atoi(argv[3])) : (int)max(1u, thread::hardware_concurrency())); return 0; }
+    if (mode=="--recover" && argc>2) {
+        Engine engine; auto r0 = chrono::steady_clock::now();
+        u64 next = recoverEngine(engine, argv[2], argc>3 ? argv[3] : "");
+        cout<<"Recovered through command "<<next<<" in "<<chrono::duration<double, milli>(chrono::steady_clock::now() - r0).count()<<" ms: "
+            <<engine.pool.bump<<" pool records, bestBid "<<engine.book.bestBid<<" bestAsk "<<engine.book.bestAsk<<"\n";
+        cout<<"Trades: "<<engine.tradeCount<<"\n";
+        return 0;
+    }
+#endif
+    auto c0 = chrono::steady_clock::now();
+    Engine engine;
+    double ctorMs = chrono::duration<double, milli>(chrono::steady_clock::now() - c0).count();
+    unique_ptr<Journal> journal;
+    if (mode=="--journal" && argc>2) { journal = make_unique<Journal>(argv[2]); engine.setJournal(journal.get()); }
+#ifdef __unix__
+    if (mode=="--restore" && argc>2) {
+        auto r0 = chrono::steady_clock::now(); loadSnapshot(engine, argv[2]);
+        cout<<"Engine ctor "<<ctorMs<<" ms, restored "<<engine.pool.bump<<" records from "<<argv[2]<<" in "
+            <<chrono::duration<double, milli>(chrono::steady_clock::now() - r0).count()<<" ms\n";
+    } else
+#endif
+    { double ms = preload(engine); cout<<"Engine ctor "<<ctorMs<<" ms, preload "<<ms<<" ms\n"; }
+    if (mode=="--snapshot" && argc>2) {
+        auto s0 = chrono::steady_clock::now(); size_t bytes = saveSnapshot(engine, argv[2]);
+        cout<<"Wrote "<<bytes<<" byte snapshot to "<<argv[2]<<" in "<<chrono::duration<double, milli>(chrono::steady_clock::now() - s0).count()<<" ms\n";
+        return 0;
+    }
+    if (mode=="--pipeline") {
+        WaitMode w = (argc>2 && string(argv[2])=="spin") ? WaitMode::SPIN : WaitMode::BACKOFF;
+        RuntimeConfig rc; rc.wait = w; rc.match.core = argc>3 ? atoi(argv[3]) : -1;
+        runPipeline(engine, rc); return 0;
+    }
+    if (mode=="--production") {
+        // busy-poll on cores 1..3 (core 0 left to the OS) when the machine has them
+        bool cores = thread::hardware_concurrency() >= 4;
+        RuntimeConfig rc; rc.wait = argc>2 ? (string(argv[2])=="spin" ? WaitMode::SPIN : WaitMode::BACKOFF) : cores ? WaitMode::SPIN : WaitMode::BACKOFF;
+        rc.ingress.core = argc>3 ? atoi(argv[3]) : cores ? 1 : -1;
+        rc.match.core = argc>4 ? atoi(argv[4]) : cores ? 2 : -1;
+        rc.sink.core = argc>5 ? atoi(argv[5]) : cores ? 3 : -1;
+        rc.ingress.fifoPriority = rc.match.fifoPriority = rc.sink.fifoPriority = argc>6 ? atoi(argv[6]) : cores ? 50 : 0;
+        rc.ingress.noAlloc = rc.match.noAlloc = rc.sink.noAlloc = true;
+        rc.sinkThread = rc.lockMemory = rc.prefault = true;
+        runPipeline(engine, rc); return 0;
     }
     cout<<"Preload done. Starting workload...\n";
+    RingReportSink firstReports(1<<10, OverflowPolicy::DROP); // keep the workload's first reports for printing
+    engine.setSink(&firstReports);
 
-    WorkloadGen gen(123, pm, 49.0, 51.0);
+    WorkloadGen gen(123, DEMO_LO, DEMO_HI);
     const int TOTAL = 500000; // tune
+    PerfCounters pc; pc.start();
     auto t0 = chrono::high_resolution_clock::now();
     for (int i=0;i<TOTAL;i++){
+        if (journal && argc>3 && i==TOTAL/2) { // a snapshot paired with the journal, for --recover <journal> <snapshot>
+            size_t bytes = saveSnapshot(engine, argv[3]); cout<<"Snapshot at command "<<journal->seq<<" ("<<bytes<<" bytes) to "<<argv[3]<<"\n";
+        }
         auto tup = gen.next();
         OrderType otype = std::get<0>(tup);
         Side side = std::get<1>(tup);
-        int pidx = std::get<2>(tup);
+        Price px = std::get<2>(tup);
         i64 qty = std::get<3>(tup);
-        if (otype==OrderType::MARKET) engine.placeMarket(engine.nextClientId++, side, qty, chrono::high_resolution_clock::now());
+        if (otype==OrderType::MARKET) engine.placeMarket(engine.nextClientId++, side, qty);
         else {
             // occasionally place IOC
             TimeInForce tif = (i%200==0)?TimeInForce::IOC:TimeInForce::GFD;
-            engine.placeLimit(engine.nextClientId++, side, pidx, qty, chrono::high_resolution_clock::now(), tif);
+            engine.placeLimit(engine.nextClientId++, side, px, qty, 0, tif);
         }
         // occasionally cancel random client (demo)
         if ((i%10000)==0 && i>0) {
@@ -295,10 +2853,22 @@ int main(){
         }
     }
     auto t1 = chrono::high_resolution_clock::now();
+    pc.stop();
     double secs = chrono::duration<double>(t1-t0).count();
     cout<<"Done. Orders: "<<TOTAL<<" Time: "<<secs<<"s Throughput: "<< (TOTAL/secs) <<" orders/s\n";
-    cout<<"Trades: "<<engine.trades.size()<<"\n";
+    pc.report(cout, TOTAL);
+    HFT_LAT_ONLY(engine.stats.report(cout);)
+    cout<<"Trades: "<<engine.tradeCount<<"\n";
+    if (journal) {
+        u64 n = journal->seq; journal->close();
+        cout<<"Journal: "<<n<<" commands, "<<journal->groups.load()<<" group commits, "<<journal->pagesWritten.load()<<" pages written, "
+            <<journal->stalls<<" ring stalls, "<<(journal->direct?"O_DIRECT":"buffered")<<(journal->ioError.load()?", I/O ERROR":"")<<"\n";
+    }
     // print few trades
-    for (size_t i=0;i<min((size_t)10, engine.trades.size()); ++i){ auto &tr = engine.trades[i]; cout<<i<<": taker="<<tr.takerClient<<" maker="<<tr.makerClient<<" qty="<<tr.qty<<" price="<<idxToPrice(tr.priceIdx)<<"\n"; }
+    ExecReport r;
+    for (size_t i=0;i<10 && firstReports.poll(r);) {
+        if (r.isTrade()) cout<<i++<<": taker="<<r.clientId<<" maker="<<r.counterparty<<" qty="<<r.qty<<" price="<<formatPrice(r.price)<<"\n";
+    }
     return 0;
 }
+#endif // HFT_SIM_NO_MAIN